@@ -4,39 +4,295 @@
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <GL/glut.h>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-struct Vector3D {
-    double x, y, z;
-    Vector3D(double x = 0, double y = 0, double z = 0) : x(x), y(y), z(z) {}
+// Scene geometry is stored in Real. Build with -DRT_SINGLE_PRECISION to
+// store it in float; rays, hit points, normals, colours and the packed SIMD
+// kernels stay in double either way, so a float build renders what the
+// double one does wherever the scene's coordinates are exact in float.
+#ifdef RT_SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+template <typename T>
+struct Vector3 {
+    T x, y, z;
+    constexpr Vector3(double x = 0, double y = 0, double z = 0) : x(x), y(y), z(z) {}
+    template <typename U>
+    explicit constexpr Vector3(const Vector3<U>& v) : x(v.x), y(v.y), z(v.z) {}
+
+    friend constexpr Vector3 operator*(const Vector3& v, T scalar) {
+        return Vector3(v.x * scalar, v.y * scalar, v.z * scalar);
+    }
 
-    friend Vector3D operator*(const Vector3D& v, double scalar) {
-        return Vector3D(v.x * scalar, v.y * scalar, v.z * scalar);
+    friend constexpr Vector3 operator+(const Vector3& v1, const Vector3& v2) {
+        return Vector3(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
     }
 
-    friend Vector3D operator+(const Vector3D& v1, const Vector3D& v2) {
-        return Vector3D(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
+    friend constexpr Vector3 operator-(const Vector3& v1, const Vector3& v2) {
+        return Vector3(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);
     }
 
-    friend Vector3D operator-(const Vector3D& v1, const Vector3D& v2) {
-        return Vector3D(v1.x - v2.x, v1.y - v2.y, v1.z - v2.z);
+    friend constexpr Vector3 operator-(const Vector3& v) {
+        return Vector3(-v.x, -v.y, -v.z);
     }
 };
 
+typedef Vector3<Real> Vector3D;
+
+template <typename T>
+constexpr T dot(const Vector3<T>& a, const Vector3<T>& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+template <typename T>
+constexpr Vector3<T> cross(const Vector3<T>& a, const Vector3<T>& b) {
+    return Vector3<T>(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+template <typename T>
+constexpr T lengthSquared(const Vector3<T>& v) {
+    return dot(v, v);
+}
+
+template <typename T>
+inline T length(const Vector3<T>& v) {
+    return std::sqrt(dot(v, v));
+}
+
+// The hardware estimate plus one Newton step is good to about 23 bits.
+inline float rsqrt(float x) {
+#if defined(__SSE__)
+    float e = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return e * (1.5f - 0.5f * x * e * e);
+#elif defined(__ARM_NEON)
+    float32x2_t v = vdup_n_f32(x);
+    float32x2_t e = vrsqrte_f32(v);
+    e = vmul_f32(e, vrsqrts_f32(vmul_f32(v, e), e));
+    return vget_lane_f32(e, 0);
+#else
+    return 1.0f / std::sqrt(x);
+#endif
+}
+
+// Divides by the length, as the hand-written normalisation did, so double
+// results stay bit-identical to it.
+inline Vector3<double> normalize(const Vector3<double>& v) {
+    double len = length(v);
+    return Vector3<double>(v.x / len, v.y / len, v.z / len);
+}
+
+inline Vector3<float> normalize(const Vector3<float>& v) {
+    return v * rsqrt(dot(v, v));
+}
+
+// Mirrors d about the plane with unit normal n.
+template <typename T>
+constexpr Vector3<T> reflect(const Vector3<T>& d, const Vector3<T>& n) {
+    return d - n * (2 * dot(d, n));
+}
+
+// Same tie and NaN behaviour as std::min and std::max per component.
+template <typename T>
+constexpr Vector3<T> componentMin(const Vector3<T>& a, const Vector3<T>& b) {
+    return Vector3<T>(b.x < a.x ? b.x : a.x, b.y < a.y ? b.y : a.y, b.z < a.z ? b.z : a.z);
+}
+
+template <typename T>
+constexpr Vector3<T> componentMax(const Vector3<T>& a, const Vector3<T>& b) {
+    return Vector3<T>(a.x < b.x ? b.x : a.x, a.y < b.y ? b.y : a.y, a.z < b.z ? b.z : a.z);
+}
+
+template <typename T>
+constexpr Vector3<T> lerp(const Vector3<T>& a, const Vector3<T>& b, T t) {
+    return a + (b - a) * t;
+}
+
+// Secondary rays start a little way along their direction so they do not
+// hit the surface they leave. The offset grows with the magnitude of the
+// origin, since that is what the rounding error in the hit point scales
+// with; in double it stays at the historical 1e-6 for any coordinate under
+// a million.
+template <typename T> struct RayEpsilon;
+template <> struct RayEpsilon<double> {
+    static constexpr double absolute = 1e-6;
+    static constexpr double relative = 1e-12;
+};
+template <> struct RayEpsilon<float> {
+    static constexpr float absolute = 1e-4f;
+    static constexpr float relative = 1e-5f;
+};
+
+template <typename T>
+inline T rayOffset(const Vector3<T>& origin) {
+    T magnitude = std::max(std::fabs(origin.x), std::max(std::fabs(origin.y), std::fabs(origin.z)));
+    return std::max(RayEpsilon<T>::absolute, RayEpsilon<T>::relative * magnitude);
+}
+
+// Besides the unit direction a ray carries its reciprocal and the sign of
+// each component, so slab tests need no divides and can read the near and
+// far box planes directly, and the (tMin, tMax) interval it is valid over.
+// Every box, primitive and occlusion test only accepts hits inside it;
+// shadow rays end at their light.
 class Ray {
 public:
-    Vector3D start;
-    Vector3D dir;
+    Vector3<double> start;
+    Vector3<double> dir;
+    Vector3<double> invDir;
+    int sign[3];
+    double tMin = 0;
+    double tMax;
+    double coneWidth = 0;
+    double coneSpread = 0;
+
+    Ray(Vector3<double> start, Vector3<double> dir, double tMax = std::numeric_limits<double>::infinity())
+        : start(start), dir(normalize(dir)), tMax(tMax) {
+        invDir = Vector3<double>(1.0 / this->dir.x, 1.0 / this->dir.y, 1.0 / this->dir.z);
+        sign[0] = invDir.x < 0;
+        sign[1] = invDir.y < 0;
+        sign[2] = invDir.z < 0;
+    }
+};
+
+#include "2005063_simd.h"
+
+struct AABB {
+    Vector3D min, max;
+
+    AABB() {
+        double inf = std::numeric_limits<double>::infinity();
+        min = Vector3D(inf, inf, inf);
+        max = Vector3D(-inf, -inf, -inf);
+    }
+    AABB(Vector3D min, Vector3D max) : min(min), max(max) {}
+
+    static AABB infinite() {
+        double inf = std::numeric_limits<double>::infinity();
+        return AABB(Vector3D(-inf, -inf, -inf), Vector3D(inf, inf, inf));
+    }
+
+    void expand(const Vector3D& p) {
+        min = componentMin(min, p);
+        max = componentMax(max, p);
+    }
 
-    Ray(Vector3D start, Vector3D dir) : start(start), dir(dir) {
-        double magnitude = sqrt(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
-        this->dir.x /= magnitude;
-        this->dir.y /= magnitude;
-        this->dir.z /= magnitude;
+    void expand(const AABB& box) {
+        if (box.min.x > box.max.x) return;
+        expand(box.min);
+        expand(box.max);
+    }
+
+    bool isFinite() const {
+        return std::isfinite(min.x) && std::isfinite(min.y) && std::isfinite(min.z) &&
+               std::isfinite(max.x) && std::isfinite(max.y) && std::isfinite(max.z);
+    }
+
+    Vector3D centroid() const {
+        return (min + max) * 0.5;
+    }
+
+    double surfaceArea() const {
+        Vector3D d = max - min;
+        if (d.x < 0 || d.y < 0 || d.z < 0) return 0.0;
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    const Vector3D& corner(int upper) const {
+        return upper ? max : min;
+    }
+
+    // Entry distance of the ray into the box, or infinity when it misses or
+    // only enters beyond tMax.
+    double intersect(const Ray& ray, double tMax) const {
+        double tNear = (corner(ray.sign[0]).x - ray.start.x) * ray.invDir.x;
+        double tFar = (corner(1 - ray.sign[0]).x - ray.start.x) * ray.invDir.x;
+        tNear = std::max<double>(tNear, (corner(ray.sign[1]).y - ray.start.y) * ray.invDir.y);
+        tFar = std::min<double>(tFar, (corner(1 - ray.sign[1]).y - ray.start.y) * ray.invDir.y);
+        tNear = std::max<double>(tNear, (corner(ray.sign[2]).z - ray.start.z) * ray.invDir.z);
+        tFar = std::min<double>(tFar, (corner(1 - ray.sign[2]).z - ray.start.z) * ray.invDir.z);
+        if (tFar >= tNear && tFar > ray.tMin && tNear < tMax) return tNear;
+        return std::numeric_limits<double>::infinity();
+    }
+};
+
+struct RenderStats {
+    long long primaryRays = 0;
+    long long shadowRays = 0;
+    long long coneSkippedRays = 0;
+    long long backfaceSkippedRays = 0;
+    long long reflectionRays = 0;
+    long long paths = 0;
+    long long pathSegments = 0;
+    long long roulettePaths = 0;
+    double primaryTime = 0;
+    double shadowTime = 0;
+    double reflectionTime = 0;
+    long long pixelSamples = 0;
+    long long refinedPixels = 0;
+    PacketStats packets;
+    long long intersectionTests[PRIM_KIND_COUNT] = {};
+    long long intersectionHits[PRIM_KIND_COUNT] = {};
+
+    double averagePathLength() const {
+        return paths > 0 ? (double)pathSegments / paths : 0.0;
+    }
+
+    long long totalRays() const {
+        return primaryRays + shadowRays + reflectionRays;
+    }
+
+    long long totalTests() const {
+        long long total = 0;
+        for (int kind = 0; kind < PRIM_KIND_COUNT; kind++) total += intersectionTests[kind];
+        return total;
+    }
+
+    void countTests(int kind, long long tests, long long hits) {
+        intersectionTests[kind] += tests;
+        intersectionHits[kind] += hits;
+    }
+
+    void add(const RenderStats& other) {
+        primaryRays += other.primaryRays;
+        shadowRays += other.shadowRays;
+        coneSkippedRays += other.coneSkippedRays;
+        backfaceSkippedRays += other.backfaceSkippedRays;
+        reflectionRays += other.reflectionRays;
+        paths += other.paths;
+        pathSegments += other.pathSegments;
+        roulettePaths += other.roulettePaths;
+        primaryTime += other.primaryTime;
+        shadowTime += other.shadowTime;
+        reflectionTime += other.reflectionTime;
+        pixelSamples += other.pixelSamples;
+        refinedPixels += other.refinedPixels;
+        packets.add(other.packets);
+        for (int kind = 0; kind < PRIM_KIND_COUNT; kind++) {
+            intersectionTests[kind] += other.intersectionTests[kind];
+            intersectionHits[kind] += other.intersectionHits[kind];
+        }
     }
 };
 
@@ -47,8 +303,9 @@ public:
     double color[3];
     double coEfficients[4];
     int shine;
+    double metallic, roughness;
 
-    Object() : height(0), width(0), length(0), shine(0) {
+    Object() : height(0), width(0), length(0), shine(0), metallic(0), roughness(0) {
         color[0] = color[1] = color[2] = 0;
         coEfficients[0] = coEfficients[1] = coEfficients[2] = coEfficients[3] = 0;
     }
@@ -64,12 +321,51 @@ public:
         coEfficients[2] = specular;
         coEfficients[3] = reflection;
     }
-    virtual double intersect(Ray* ray, double* color, int level) {
+    virtual double intersect(Ray* ray) {
         return -1.0;
     }
+    virtual bool occludes(Ray* ray) {
+        double t = intersect(ray);
+        return t > ray->tMin && t < ray->tMax;
+    }
+    // The counted entry points the BVH uses. A plain object is one test; an
+    // object with its own hierarchy reports the primitives it really tested.
+    virtual bool occludesCounted(Ray* ray, RenderStats* counters) {
+        bool blocked = occludes(ray);
+        if (counters) counters->countTests(getPrimitiveKind(), 1, blocked);
+        return blocked;
+    }
+    virtual double intersectPart(Ray* ray, int& part, RenderStats* counters = nullptr) {
+        part = -1;
+        double t = intersect(ray);
+        if (counters) counters->countTests(getPrimitiveKind(), 1, t > ray->tMin);
+        return t;
+    }
+    virtual Vector3<double> getNormal(const Vector3<double>& point, int part = -1) {
+        return Vector3<double>(0, 0, 1);
+    }
+    virtual Vector3<double> getColorAt(const Vector3<double>& point, double footprint = 0) {
+        return Vector3<double>(color[0], color[1], color[2]);
+    }
+    virtual AABB getBounds() {
+        return AABB::infinite();
+    }
+    virtual int getPrimitiveKind() {
+        return PRIM_OTHER;
+    }
+    virtual void pack(PackedPrimitives& packed, int index) {}
     virtual ~Object() {}
 };
 
+struct HitRecord {
+    double t;
+    Vector3<double> point;
+    Vector3<double> normal;
+    double footprint;
+    Object* object;
+    int part;
+};
+
 class PointLight {
 public:
     Vector3D light_pos;
@@ -85,9 +381,13 @@ class SpotLight : public PointLight {
 public:
     Vector3D light_direction;
     double cutoff_angle;
+    double cosCutoff;
 
     SpotLight(Vector3D pos, double r, double g, double b, Vector3D dir, double cutoff)
-        : PointLight(pos, r, g, b), light_direction(dir), cutoff_angle(cutoff) {}
+        : PointLight(pos, r, g, b), light_direction(dir), cutoff_angle(cutoff) {
+        light_direction = normalize(dir);
+        cosCutoff = cos(cutoff * M_PI / 180.0);
+    }
 };
 
 extern std::vector<PointLight> pointLights;
@@ -96,130 +396,1077 @@ extern std::vector<Object*> objects;
 extern class Floor* globalFloor;
 
 extern int recursionLevel;
+extern int maxPathDepth;
+extern double minPathThroughput;
+extern double rouletteThroughput;
+extern bool watertightTriangles;
 
 extern float cameraRadius;
 extern float cameraAngle;
 extern float cameraHeight;
 
-class Sphere : public Object {
+extern int exactLightLimit;
+extern int lightSamplesPerHit;
+extern double lightRange;
+
+inline bool spotCovers(const SpotLight& light, const Vector3<double>& lightDir) {
+    double cosTheta = -dot(lightDir, Vector3<double>(light.light_direction));
+    return cosTheta >= light.cosCutoff;
+}
+
+// Binary tree over every point and spot light, split at the median of the
+// widest axis. Lights are numbered pointLights first, then spotLights. Each
+// node keeps the box around its lights and their summed brightness so that a
+// shading point can pick one light with probability proportional to a bound
+// on what each subtree could contribute there.
+class LightTree {
 public:
-    Sphere(Vector3D center, double radius) {
-        reference_point = center;
-        length = radius;
+    struct Node {
+        AABB bounds;
+        double power;
+        int left;
+        int light;
+    };
+
+    std::vector<Node> nodes;
+
+    void build() {
+        nodes.clear();
+        std::vector<int> entries(pointLights.size() + spotLights.size());
+        for (size_t i = 0; i < entries.size(); i++) entries[i] = i;
+        if (entries.empty()) return;
+        nodes.reserve(2 * entries.size());
+        nodes.push_back(Node());
+        buildNode(0, entries, 0, entries.size());
     }
 
-    void draw() override {
-        glPushMatrix();
-        glColor3f(color[0], color[1], color[2]);
-        glTranslatef(reference_point.x, reference_point.y, reference_point.z);
-        glutSolidSphere(length, 50, 50);
-        glPopMatrix();
+    void clear() {
+        nodes.clear();
+    }
+
+    bool empty() const {
+        return nodes.empty();
     }
 
-    double intersect(Ray* ray, double* color, int level) override {
-        Vector3D oc = {ray->start.x - reference_point.x, ray->start.y - reference_point.y, ray->start.z - reference_point.z};
-        double a = 1.0;
-        double b = 2.0 * (oc.x * ray->dir.x + oc.y * ray->dir.y + oc.z * ray->dir.z);
-        double c = oc.x * oc.x + oc.y * oc.y + oc.z * oc.z - length * length;
-        double discriminant = b * b - 4 * a * c;
+    static const PointLight& lightAt(int entry) {
+        if (entry < (int)pointLights.size()) return pointLights[entry];
+        return spotLights[entry - pointLights.size()];
+    }
 
-        if (discriminant < 0) return -1.0;
+    // Returns the chosen light, or -1 when nothing can reach the point, and
+    // the probability of having chosen it.
+    int sample(const Vector3<double>& point, const Vector3<double>& normal, double u, double& pdf) const {
+        pdf = 1.0;
+        if (nodes.empty() || importance(nodes[0], point, normal) <= 0) return -1;
+        int index = 0;
+        while (nodes[index].left >= 0) {
+            int left = nodes[index].left;
+            double leftWeight = importance(nodes[left], point, normal);
+            double rightWeight = importance(nodes[left + 1], point, normal);
+            double total = leftWeight + rightWeight;
+            if (total <= 0) return -1;
+            double p = leftWeight / total;
+            if (u < p) {
+                u /= p;
+                pdf *= p;
+                index = left;
+            } else {
+                u = (u - p) / (1.0 - p);
+                pdf *= 1.0 - p;
+                index = left + 1;
+            }
+            u = std::min(u, 1.0 - 1e-12);
+        }
+        return nodes[index].light;
+    }
 
-        double t1 = (-b - sqrt(discriminant)) / (2.0 * a);
-        double t2 = (-b + sqrt(discriminant)) / (2.0 * a);
+private:
+    static Vector3D positionOf(int entry) {
+        return lightAt(entry).light_pos;
+    }
 
-        double t = (t1 > 0) ? t1 : ((t2 > 0) ? t2 : -1.0);
-        if (t < 0) return -1.0;
+    void buildNode(int index, std::vector<int>& entries, int first, int count) {
+        Node node;
+        node.power = 0;
+        node.left = -1;
+        node.light = -1;
+        for (int i = first; i < first + count; i++) {
+            const PointLight& light = lightAt(entries[i]);
+            node.bounds.expand(light.light_pos);
+            node.power += (light.color[0] + light.color[1] + light.color[2]) / 3.0;
+        }
+        if (count == 1) {
+            node.light = entries[first];
+            nodes[index] = node;
+            return;
+        }
+
+        Vector3D extent = node.bounds.max - node.bounds.min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        auto key = [axis](const Vector3D& p) { return axis == 0 ? p.x : axis == 1 ? p.y : p.z; };
+        int half = count / 2;
+        std::nth_element(entries.begin() + first, entries.begin() + first + half, entries.begin() + first + count,
+                         [&](int a, int b) { return key(positionOf(a)) < key(positionOf(b)); });
+
+        node.left = nodes.size();
+        nodes[index] = node;
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        buildNode(node.left, entries, first, half);
+        buildNode(node.left + 1, entries, first + half, count - half);
+    }
+
+    // Brightness times a bound on the cosine between the surface normal and
+    // any direction into the node's box. Lights behind the surface still get
+    // a small share because the Phong and Fresnel lobes do not vanish there.
+    // A single spot light that cannot see the point, or a box entirely
+    // beyond lightRange, contributes nothing.
+    double importance(const Node& node, const Vector3<double>& point, const Vector3<double>& normal) const {
+        if (node.power <= 0) return 0;
+        Vector3<double> boxMin(node.bounds.min), boxMax(node.bounds.max);
+        Vector3<double> nearest = componentMax(boxMin, componentMin(point, boxMax));
+        Vector3<double> gap = nearest - point;
+        if (lengthSquared(gap) > lightRange * lightRange) return 0;
+
+        Vector3<double> toCenter = Vector3<double>(node.bounds.centroid()) - point;
+        double distance = length(toCenter);
+        Vector3D half = (node.bounds.max - node.bounds.min) * 0.5;
+        double radius = length(half);
+
+        if (node.left < 0 && node.light >= (int)pointLights.size() && distance > 0) {
+            Vector3<double> lightDir = toCenter * (1.0 / distance);
+            if (!spotCovers(spotLights[node.light - pointLights.size()], lightDir)) return 0;
+        }
+
+        double cosine = 1.0;
+        if (distance > radius) {
+            double cosAngle = std::max(-1.0, std::min(1.0, dot(normal, toCenter) / distance));
+            double sinSpread = radius / distance;
+            double cosSpread = sqrt(1.0 - sinSpread * sinSpread);
+            if (cosAngle < cosSpread) {
+                cosine = cosAngle * cosSpread + sqrt(1.0 - cosAngle * cosAngle) * sinSpread;
+            }
+        }
+        return node.power * std::max(cosine, 0.05);
+    }
+};
 
-        if (level == 0) return t;
+extern LightTree lightTree;
 
-        Vector3D intersectionPoint = ray->start + ray->dir * t;
+struct HdrImage {
+    int width, height;
+    std::vector<float> pixels;
 
-        Vector3D normal = intersectionPoint - reference_point;
-        double magnitude = sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
-        normal.x /= magnitude;
-        normal.y /= magnitude;
-        normal.z /= magnitude;
+    HdrImage(int width = 0, int height = 0) : width(width), height(height), pixels(3 * (size_t)width * height, 0.0f) {}
 
-        color[0] = coEfficients[0] * this->color[0];
-        color[1] = coEfficients[0] * this->color[1];
-        color[2] = coEfficients[0] * this->color[2];
+    float* at(int i, int j) {
+        return &pixels[3 * ((size_t)j * width + i)];
+    }
 
-        for (const auto& light : pointLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
+    const float* at(int i, int j) const {
+        return &pixels[3 * ((size_t)j * width + i)];
+    }
+};
 
-            Ray shadowRay(intersectionPoint + lightDir * 1e-6, lightDir);
-            bool inShadow = false;
-            for (const auto& obj : objects) {
-                if (obj->intersect(&shadowRay, color, 0) > 0 && obj->intersect(&shadowRay, color, 0) < lightDist) {
-                    inShadow = true;
-                    break;
+enum ToneMapOperator {
+    TONEMAP_CLAMP,
+    TONEMAP_REINHARD,
+    TONEMAP_ACES
+};
+
+inline unsigned char toneMapChannel(double value, ToneMapOperator op, double scale) {
+    value = std::max(0.0, value * scale);
+    if (op == TONEMAP_REINHARD) {
+        value = value / (1.0 + value);
+    } else if (op == TONEMAP_ACES) {
+        value = (value * (2.51 * value + 0.03)) / (value * (2.43 * value + 0.59) + 0.14);
+    }
+    return (unsigned char)(std::min(1.0, value) * 255);
+}
+
+struct BVHNode {
+    AABB bounds;
+    int leftFirst;
+    int count;
+    int sphereCount;
+    int triangleCount;
+};
+
+class BVH {
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<Object*> primitives;
+    std::vector<Object*> unbounded;
+    PackedPrimitives packed;
+
+    void build(const std::vector<Object*>& sceneObjects) {
+        nodes.clear();
+        primitives.clear();
+        unbounded.clear();
+
+        std::vector<Object*> bounded;
+        std::vector<AABB> bounds;
+        for (Object* obj : sceneObjects) {
+            AABB box = obj->getBounds();
+            if (!box.isFinite()) {
+                unbounded.push_back(obj);
+                continue;
+            }
+            bounded.push_back(obj);
+            bounds.push_back(box);
+        }
+
+        std::vector<int> order = buildNodes(bounds, nodes);
+        primitives.reserve(order.size());
+        for (int index : order) {
+            primitives.push_back(bounded[index]);
+        }
+
+        packed.watertight = watertightTriangles;
+        packed.resize((int)primitives.size());
+        for (auto& node : nodes) {
+            node.sphereCount = node.triangleCount = 0;
+            if (node.count == 0) continue;
+
+            auto first = primitives.begin() + node.leftFirst;
+            std::stable_sort(first, first + node.count, [](Object* a, Object* b) {
+                return a->getPrimitiveKind() < b->getPrimitiveKind();
+            });
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                int kind = primitives[i]->getPrimitiveKind();
+                if (kind == PRIM_SPHERE) node.sphereCount++;
+                if (kind == PRIM_TRIANGLE) node.triangleCount++;
+                primitives[i]->pack(packed, i);
+            }
+        }
+    }
+
+    bool intersectNearest(Ray* ray, HitRecord& hit, RenderStats* counters = nullptr) {
+        Object* nearestObject = nullptr;
+        Object* partObject = nullptr;
+        double tNearest = ray->tMax;
+        int part, nearestPart = -1;
+
+        for (Object* obj : unbounded) {
+            double t = obj->intersectPart(ray, part, counters);
+            if (t > ray->tMin && t < tNearest) {
+                tNearest = t;
+                nearestObject = partObject = obj;
+                nearestPart = part;
+            }
+        }
+
+        traverseNearest(nodes, *ray, tNearest, [&](const BVHNode& node) {
+            int hitIndex = -1;
+            int first = node.leftFirst;
+            int sphereHits = intersectPacked<PRIM_SPHERE>(packed, first, node.sphereCount, *ray, tNearest, hitIndex);
+            first += node.sphereCount;
+            int triangleHits = intersectPacked<PRIM_TRIANGLE>(packed, first, node.triangleCount, *ray, tNearest, hitIndex);
+            first += node.triangleCount;
+            if (counters) {
+                counters->countTests(PRIM_SPHERE, node.sphereCount, sphereHits);
+                counters->countTests(PRIM_TRIANGLE, node.triangleCount, triangleHits);
+            }
+            for (int i = first; i < node.leftFirst + node.count; i++) {
+                double t = primitives[i]->intersectPart(ray, part, counters);
+                if (t > ray->tMin && t < tNearest) {
+                    tNearest = t;
+                    hitIndex = i;
+                    partObject = primitives[i];
+                    nearestPart = part;
                 }
             }
+            if (hitIndex >= 0) nearestObject = primitives[hitIndex];
+        });
 
-            if (inShadow) continue;
+        if (!nearestObject) return false;
 
-            double lambert = std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z);
-            color[0] += coEfficients[1] * light.color[0] * lambert * this->color[0];
-            color[1] += coEfficients[1] * light.color[1] * lambert * this->color[1];
-            color[2] += coEfficients[1] * light.color[2] * lambert * this->color[2];
+        fillHit(ray, nearestObject, tNearest, hit, nearestObject == partObject ? nearestPart : -1);
+        return true;
+    }
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double phong = std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z));
-            phong = pow(phong, shine);
-            color[0] += coEfficients[2] * light.color[0] * phong;
-            color[1] += coEfficients[2] * light.color[1] * phong;
-            color[2] += coEfficients[2] * light.color[2] * phong;
+    void intersectPacket(Ray* rays, RayPacket& packet, Object** hitObjects, PacketStats& stats, RenderStats* counters = nullptr) {
+        int activeLanes = 0;
+        for (int lane = 0; lane < RayPacket::size; lane++) {
+            hitObjects[lane] = nullptr;
+            if (!packet.active[lane]) continue;
+            activeLanes++;
+            for (Object* obj : unbounded) {
+                int part;
+                double t = obj->intersectPart(&rays[lane], part, counters);
+                if (t > rays[lane].tMin && t < packet.tNearest[lane]) {
+                    packet.tNearest[lane] = t;
+                    packet.hitPart[lane] = part;
+                    hitObjects[lane] = obj;
+                }
+            }
         }
 
-        double metallic = 0.5;
-        double roughness = 0.5;
+        stats.packets++;
+        bool split = false;
+        packet.buildFrustum();
+        int representative = RayPacket::size / 2;
+
+        int stack[64];
+        int stackSize = 0;
+        if (!nodes.empty()) stack[stackSize++] = 0;
 
-        for (const auto& light : pointLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
+        while (stackSize > 0) {
+            const BVHNode& node = nodes[stack[--stackSize]];
+            stats.nodeVisits++;
 
-            double fresnel = pow(1.0 - std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z), 5.0);
-            fresnel = fresnel * (1.0 - metallic) + metallic;
+            if (packet.frustumMisses(node.bounds.min, node.bounds.max)) {
+                stats.frustumCulled++;
+                continue;
+            }
+            int entering = packetEntersBox(packet, node.bounds.min, node.bounds.max);
+            if (entering == 0) continue;
+            if (entering < activeLanes) {
+                stats.divergentNodes++;
+                split = true;
+            }
+
+            if (node.count > 0) {
+                int first = node.leftFirst;
+                int sphereHits = 0, triangleHits = 0;
+                for (int i = first; i < first + node.sphereCount; i++) {
+                    sphereHits += intersectPacketLanes<PRIM_SPHERE>(packed, i, packet);
+                }
+                first += node.sphereCount;
+                for (int i = first; i < first + node.triangleCount; i++) {
+                    triangleHits += intersectPacketLanes<PRIM_TRIANGLE>(packed, i, packet);
+                }
+                first += node.triangleCount;
+                if (counters) {
+                    counters->countTests(PRIM_SPHERE, (long long)node.sphereCount * activeLanes, sphereHits);
+                    counters->countTests(PRIM_TRIANGLE, (long long)node.triangleCount * activeLanes, triangleHits);
+                }
+                for (int i = first; i < node.leftFirst + node.count; i++) {
+                    for (int lane = 0; lane < RayPacket::size; lane++) {
+                        if (!packet.active[lane]) continue;
+                        int part;
+                        double t = primitives[i]->intersectPart(&rays[lane], part, counters);
+                        if (t > rays[lane].tMin && t < packet.tNearest[lane]) {
+                            packet.tNearest[lane] = t;
+                            packet.hitIndex[lane] = i;
+                            packet.hitPart[lane] = part;
+                        }
+                    }
+                }
+                continue;
+            }
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double specular = pow(std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z)), 1.0 / roughness);
+            int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+            Vector3D gap = nodes[farChild].bounds.centroid() - nodes[nearChild].bounds.centroid();
+            double along = fabs(gap.x) > fabs(gap.y) ? (fabs(gap.x) > fabs(gap.z) ? gap.x * packet.dx[representative] : gap.z * packet.dz[representative])
+                                                     : (fabs(gap.y) > fabs(gap.z) ? gap.y * packet.dy[representative] : gap.z * packet.dz[representative]);
+            if (along < 0) std::swap(nearChild, farChild);
+            stack[stackSize++] = farChild;
+            stack[stackSize++] = nearChild;
+        }
 
-            color[0] += fresnel * specular * light.color[0];
-            color[1] += fresnel * specular * light.color[1];
-            color[2] += fresnel * specular * light.color[2];
+        if (split) stats.splitPackets++;
+        for (int lane = 0; lane < RayPacket::size; lane++) {
+            if (packet.active[lane] && packet.hitIndex[lane] >= 0) hitObjects[lane] = primitives[packet.hitIndex[lane]];
         }
+    }
 
-        if (level >= recursionLevel) return t;
+    // Binned SAH build over padded boxes; returns the primitive order the
+    // leaves' leftFirst/count ranges refer to.
+    static std::vector<int> buildNodes(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes) {
+        std::vector<BuildPrim> prims;
+        prims.reserve(bounds.size());
+        for (int i = 0; i < (int)bounds.size(); i++) {
+            double pad = 1e-4;
+            AABB box(bounds[i].min - Vector3D(pad, pad, pad), bounds[i].max + Vector3D(pad, pad, pad));
+            prims.push_back({box, box.centroid(), i});
+        }
 
-        Vector3D reflectDir = ray->dir - normal * (2.0 * (ray->dir.x * normal.x + ray->dir.y * normal.y + ray->dir.z * normal.z));
-        Ray reflectedRay(intersectionPoint + reflectDir * 1e-6, reflectDir);
+        nodes.clear();
+        std::vector<int> order;
+        if (prims.empty()) return order;
 
-        double reflectedColor[3] = {0, 0, 0};
-        double tMin = 1e9;
-        Object* nearestObject = nullptr;
+        nodes.reserve(2 * prims.size());
+        nodes.push_back(BVHNode());
+        subdivide(nodes, prims, 0, 0, (int)prims.size(), 0);
 
-        for (const auto& obj : objects) {
-            double t = obj->intersect(&reflectedRay, reflectedColor, level + 1);
-            if (t > 0 && t < tMin) {
-                tMin = t;
-                nearestObject = obj;
+        order.reserve(prims.size());
+        for (const auto& prim : prims) {
+            order.push_back(prim.index);
+        }
+        return order;
+    }
+
+    void adopt(std::vector<BVHNode> prebuiltNodes, std::vector<Object*> orderedPrimitives, std::vector<Object*> unboundedObjects) {
+        nodes = std::move(prebuiltNodes);
+        primitives = std::move(orderedPrimitives);
+        unbounded = std::move(unboundedObjects);
+
+        packed.watertight = watertightTriangles;
+        packed.resize((int)primitives.size());
+        for (int i = 0; i < (int)primitives.size(); i++) {
+            primitives[i]->pack(packed, i);
+        }
+    }
+
+    // Checks a node array from outside the builder before adopt() trusts it.
+    // Children must sit after their parent, which rules out cycles, and no
+    // path may go deeper than the builder would, so the traversal stacks hold.
+    static bool validNodes(const BVHNode* nodeArray, int nodeCount, int primitiveCount) {
+        std::vector<int> depth(nodeCount, 0);
+        for (int i = 0; i < nodeCount; i++) {
+            const BVHNode& node = nodeArray[i];
+            if (node.leftFirst < 0) return false;
+            if (node.count > 0) {
+                if (node.sphereCount < 0 || node.triangleCount < 0) return false;
+                if ((int64_t)node.leftFirst + node.count > primitiveCount) return false;
+                if ((int64_t)node.sphereCount + node.triangleCount > node.count) return false;
+                continue;
+            }
+            if (node.count < 0 || node.leftFirst <= i || (int64_t)node.leftFirst + 1 >= nodeCount) return false;
+            if (depth[i] >= MAX_DEPTH) return false;
+            for (int child = node.leftFirst; child <= node.leftFirst + 1; child++) {
+                depth[child] = std::max(depth[child], depth[i] + 1);
+            }
+        }
+        return true;
+    }
+
+    static void fillHit(Ray* ray, Object* object, double t, HitRecord& hit, int part = -1) {
+        hit.t = t;
+        hit.point = ray->start + ray->dir * t;
+        hit.part = part;
+        hit.normal = object->getNormal(hit.point, part);
+        double cosine = fabs(dot(ray->dir, hit.normal));
+        hit.footprint = (ray->coneWidth + ray->coneSpread * t) / std::max(cosine, 1e-3);
+        hit.object = object;
+    }
+
+    bool occluded(Ray* ray, RenderStats* counters = nullptr) {
+        for (Object* obj : unbounded) {
+            bool blocked = obj->occludesCounted(ray, counters);
+            if (blocked) return true;
+        }
+
+        return traverseAny(nodes, *ray, [&](const BVHNode& node) {
+            int first = node.leftFirst;
+            int tested = 0;
+            bool blocked = occludedPacked<PRIM_SPHERE>(packed, first, node.sphereCount, *ray, tested);
+            if (counters) counters->countTests(PRIM_SPHERE, tested, blocked);
+            if (blocked) return true;
+            first += node.sphereCount;
+            tested = 0;
+            blocked = occludedPacked<PRIM_TRIANGLE>(packed, first, node.triangleCount, *ray, tested);
+            if (counters) counters->countTests(PRIM_TRIANGLE, tested, blocked);
+            if (blocked) return true;
+            first += node.triangleCount;
+            for (int i = first; i < node.leftFirst + node.count; i++) {
+                blocked = primitives[i]->occludesCounted(ray, counters);
+                if (blocked) return true;
+            }
+            return false;
+        });
+    }
+
+    // Front-to-back closest-hit walk. leaf(node) tests a leaf and may shrink
+    // tNearest, which prunes everything still on the stack behind it.
+    template <typename Leaf>
+    static void traverseNearest(const std::vector<BVHNode>& nodes, const Ray& ray, double& tNearest, Leaf leaf) {
+        if (nodes.empty()) return;
+
+        int stack[64];
+        double stackT[64];
+        int stackSize = 0;
+        stack[stackSize] = 0;
+        stackT[stackSize++] = nodes[0].bounds.intersect(ray, tNearest);
+
+        while (stackSize > 0) {
+            stackSize--;
+            if (stackT[stackSize] >= tNearest) continue;
+            const BVHNode& node = nodes[stack[stackSize]];
+
+            if (node.count > 0) {
+                leaf(node);
+                continue;
+            }
+
+            int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+            double tNearChild = nodes[nearChild].bounds.intersect(ray, tNearest);
+            double tFarChild = nodes[farChild].bounds.intersect(ray, tNearest);
+            if (tFarChild < tNearChild) {
+                std::swap(nearChild, farChild);
+                std::swap(tNearChild, tFarChild);
+            }
+            if (tFarChild < tNearest) {
+                stack[stackSize] = farChild;
+                stackT[stackSize++] = tFarChild;
+            }
+            if (tNearChild < tNearest) {
+                stack[stackSize] = nearChild;
+                stackT[stackSize++] = tNearChild;
+            }
+        }
+    }
+
+    // Any-hit walk for shadow rays up to ray.tMax; stops as soon as
+    // leaf(node) returns true.
+    template <typename Leaf>
+    static bool traverseAny(const std::vector<BVHNode>& nodes, const Ray& ray, Leaf leaf) {
+        if (nodes.empty()) return false;
+
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0) {
+            const BVHNode& node = nodes[stack[--stackSize]];
+            if (node.bounds.intersect(ray, ray.tMax) == std::numeric_limits<double>::infinity()) continue;
+
+            if (node.count > 0) {
+                if (leaf(node)) return true;
+                continue;
+            }
+
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst;
+        }
+
+        return false;
+    }
+
+private:
+    struct BuildPrim {
+        AABB bounds;
+        Vector3D centroid;
+        int index;
+    };
+
+    static const int SAH_BINS = 12;
+    // Leaf primitives are tested a full SIMD block at a time, so the SAH
+    // prices a leaf by the blocks it needs and lets a leaf fill one.
+    static const int MAX_LEAF_SIZE = SimdLanes::width > 4 ? SimdLanes::width : 4;
+    static const int MAX_DEPTH = 60;
+
+    static double axisOf(const Vector3D& v, int axis) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+
+    static int laneBlocks(int count) {
+        return (count + SimdLanes::width - 1) / SimdLanes::width;
+    }
+
+    static void subdivide(std::vector<BVHNode>& nodes, std::vector<BuildPrim>& prims, int nodeIndex, int first, int count, int depth) {
+        AABB bounds, centroidBounds;
+        for (int i = first; i < first + count; i++) {
+            bounds.expand(prims[i].bounds);
+            centroidBounds.expand(prims[i].centroid);
+        }
+        nodes[nodeIndex].bounds = bounds;
+        nodes[nodeIndex].leftFirst = first;
+        nodes[nodeIndex].count = count;
+
+        if (count <= 1 || depth >= MAX_DEPTH) return;
+
+        int bestAxis = -1, bestSplit = -1;
+        double bestCost = std::numeric_limits<double>::infinity();
+
+        for (int axis = 0; axis < 3; axis++) {
+            double lo = axisOf(centroidBounds.min, axis);
+            double hi = axisOf(centroidBounds.max, axis);
+            if (hi - lo < 1e-12) continue;
+
+            AABB binBounds[SAH_BINS];
+            int binCount[SAH_BINS] = {0};
+            double scale = SAH_BINS / (hi - lo);
+            for (int i = first; i < first + count; i++) {
+                int bin = std::min(SAH_BINS - 1, (int)((axisOf(prims[i].centroid, axis) - lo) * scale));
+                binCount[bin]++;
+                binBounds[bin].expand(prims[i].bounds);
+            }
+
+            double leftArea[SAH_BINS - 1];
+            int leftCount[SAH_BINS - 1];
+            AABB leftBox;
+            int leftSum = 0;
+            for (int i = 0; i < SAH_BINS - 1; i++) {
+                leftBox.expand(binBounds[i]);
+                leftSum += binCount[i];
+                leftArea[i] = leftBox.surfaceArea();
+                leftCount[i] = leftSum;
+            }
+
+            AABB rightBox;
+            int rightSum = 0;
+            for (int i = SAH_BINS - 1; i > 0; i--) {
+                rightBox.expand(binBounds[i]);
+                rightSum += binCount[i];
+                if (leftCount[i - 1] == 0 || rightSum == 0) continue;
+                double cost = leftArea[i - 1] * laneBlocks(leftCount[i - 1]) + rightBox.surfaceArea() * laneBlocks(rightSum);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+
+        if (bestAxis < 0) return;
+
+        double parentArea = bounds.surfaceArea();
+        double splitCost = 1.0 + (parentArea > 0 ? bestCost / parentArea : laneBlocks(count));
+        if (splitCost >= laneBlocks(count) && count <= MAX_LEAF_SIZE) return;
+
+        double lo = axisOf(centroidBounds.min, bestAxis);
+        double scale = SAH_BINS / (axisOf(centroidBounds.max, bestAxis) - lo);
+        auto middle = std::partition(prims.begin() + first, prims.begin() + first + count, [&](const BuildPrim& prim) {
+            int bin = std::min(SAH_BINS - 1, (int)((axisOf(prim.centroid, bestAxis) - lo) * scale));
+            return bin < bestSplit;
+        });
+        int leftCount = (int)(middle - prims.begin()) - first;
+        if (leftCount == 0 || leftCount == count) return;
+
+        int leftChild = (int)nodes.size();
+        nodes.push_back(BVHNode());
+        nodes.push_back(BVHNode());
+        nodes[nodeIndex].leftFirst = leftChild;
+        nodes[nodeIndex].count = 0;
+
+        subdivide(nodes, prims, leftChild, first, leftCount, depth + 1);
+        subdivide(nodes, prims, leftChild + 1, first + leftCount, count - leftCount, depth + 1);
+    }
+};
+
+extern BVH sceneBVH;
+
+// Workers are started once and sleep on a condition variable between run()
+// calls; the calling thread works as worker 0 while a run is in flight.
+class WorkStealingPool {
+public:
+    int threadCount;
+
+    WorkStealingPool(int threadCount = 0) : threadCount(resolveThreads(threadCount)), queues(this->threadCount) {
+        for (int worker = 1; worker < this->threadCount; worker++) {
+            threads.emplace_back([this, worker]() { workerLoop(worker); });
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> guard(stateLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) thread.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    static int resolveThreads(int requested) {
+        if (requested <= 0) requested = (int)std::thread::hardware_concurrency();
+        return std::max(1, requested);
+    }
+
+    void run(int taskCount, const std::function<void(int task, int worker)>& work) {
+        if (threadCount == 1 || taskCount <= 1) {
+            for (int task = 0; task < taskCount; task++) work(task, 0);
+            return;
+        }
+
+        for (int task = 0; task < taskCount; task++) {
+            TaskQueue& queue = queues[task % threadCount];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.tasks.push_back(task);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(stateLock);
+            job = &work;
+            busyWorkers = threadCount - 1;
+            generation++;
+        }
+        wake.notify_all();
+
+        drain(0, work);
+
+        std::unique_lock<std::mutex> guard(stateLock);
+        finished.wait(guard, [this]() { return busyWorkers == 0; });
+        job = nullptr;
+    }
+
+private:
+    struct TaskQueue {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    std::vector<TaskQueue> queues;
+    std::vector<std::thread> threads;
+    std::mutex stateLock;
+    std::condition_variable wake, finished;
+    const std::function<void(int task, int worker)>* job = nullptr;
+    uint64_t generation = 0;
+    int busyWorkers = 0;
+    bool stopping = false;
+
+    void workerLoop(int worker) {
+        uint64_t seen = 0;
+        while (true) {
+            const std::function<void(int task, int worker)>* current;
+            {
+                std::unique_lock<std::mutex> guard(stateLock);
+                wake.wait(guard, [&]() { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                current = job;
             }
+
+            drain(worker, *current);
+
+            std::lock_guard<std::mutex> guard(stateLock);
+            if (--busyWorkers == 0) finished.notify_one();
+        }
+    }
+
+    void drain(int worker, const std::function<void(int task, int worker)>& work) {
+        int task;
+        while (popLocal(queues[worker], task) || steal(queues, worker, task)) {
+            work(task, worker);
         }
+    }
+
+    static bool popLocal(TaskQueue& queue, int& task) {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) return false;
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+    }
 
-        if (nearestObject) {
-            nearestObject->intersect(&reflectedRay, reflectedColor, level + 1);
-            color[0] += reflectedColor[0] * coEfficients[3];
-            color[1] += reflectedColor[1] * coEfficients[3];
-            color[2] += reflectedColor[2] * coEfficients[3];
+    static bool steal(std::vector<TaskQueue>& queues, int thief, int& task) {
+        int count = (int)queues.size();
+        for (int offset = 1; offset < count; offset++) {
+            TaskQueue& victim = queues[(thief + offset) % count];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.tasks.empty()) continue;
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
         }
+        return false;
+    }
+};
+
+class ScopedTimer {
+public:
+    ScopedTimer(double* total) : total(total) {
+        if (total) start = std::chrono::steady_clock::now();
+    }
+    ~ScopedTimer() {
+        if (total) *total += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    double* total;
+    std::chrono::steady_clock::time_point start;
+};
+
+class alignas(64) Integrator {
+public:
+    RenderStats stats;
+    bool timed;
+    uint64_t sampleSeed = 0;
+
+    Integrator(bool timed = false) : timed(timed) {}
+
+    // Names the pixel sample about to be traced. Random decisions along its
+    // path are seeded from it as well as from the hit point, so two samples
+    // that land on the same surface point do not make the same choice.
+    void beginSample(int x, int y, int sample) {
+        sampleSeed = mixBits(((uint64_t)(uint32_t)y << 32 | (uint32_t)x) ^ ((uint64_t)sample * 0x9E3779B97F4A7C15ULL));
+    }
+
+    bool trace(Ray* ray, double* color, int level) {
+        HitRecord hit;
+        if (!findHit(ray, hit, level)) return false;
+        shade(ray, hit, color, level);
+        return true;
+    }
+
+    // Direct light at the hit, then the mirror chain followed in a loop that
+    // carries the product of the reflection coefficients seen so far. The
+    // chain stops at the depth limit or once that product falls below
+    // minPathThroughput. With roulette enabled, a path still above that
+    // cutoff whose product drops under rouletteThroughput survives with
+    // probability product/threshold and continues at the threshold, which
+    // keeps the estimate unbiased.
+    void shade(Ray* ray, const HitRecord& hit, double* color, int level) {
+        shadeDirect(ray, hit, color);
+        stats.paths++;
+        stats.pathSegments++;
+
+        int depthLimit = maxPathDepth > 0 ? maxPathDepth : recursionLevel;
+        double throughput = hit.object->coEfficients[3];
+        Ray current = *ray;
+        HitRecord bounce = hit;
+        for (int depth = level; depth < depthLimit; depth++) {
+            if (throughput < minPathThroughput) break;
+            if (throughput < rouletteThroughput) {
+                uint64_t state = mixBits(sampleSeed + (uint64_t)depth) ^ hashPoint(bounce.point);
+                double survival = throughput / rouletteThroughput;
+                if (nextUniform(state) >= survival) {
+                    stats.roulettePaths++;
+                    break;
+                }
+                throughput = rouletteThroughput;
+            }
+
+            const Vector3<double>& normal = bounce.normal;
+            Vector3<double> reflectDir = reflect(current.dir, normal);
+            Ray reflectedRay(bounce.point + reflectDir * rayOffset(bounce.point), reflectDir);
+            reflectedRay.coneWidth = current.coneWidth + current.coneSpread * bounce.t;
+            reflectedRay.coneSpread = current.coneSpread;
+            if (!findHit(&reflectedRay, bounce, depth + 1)) break;
+            current = reflectedRay;
+            stats.pathSegments++;
+
+            double reflectedColor[3];
+            shadeDirect(&current, bounce, reflectedColor);
+            color[0] += reflectedColor[0] * throughput;
+            color[1] += reflectedColor[1] * throughput;
+            color[2] += reflectedColor[2] * throughput;
+            throughput *= bounce.object->coEfficients[3];
+        }
+    }
+
+private:
+    bool findHit(Ray* ray, HitRecord& hit, int level) {
+        if (level <= 1) {
+            stats.primaryRays++;
+            ScopedTimer timer(timed ? &stats.primaryTime : nullptr);
+            return sceneBVH.intersectNearest(ray, hit, &stats);
+        }
+        stats.reflectionRays++;
+        ScopedTimer timer(timed ? &stats.reflectionTime : nullptr);
+        return sceneBVH.intersectNearest(ray, hit, &stats);
+    }
+
+    void shadeDirect(Ray* ray, const HitRecord& hit, double* color) {
+        const Object* object = hit.object;
+        const double* coEfficients = object->coEfficients;
+        Vector3<double> surfaceColor = hit.object->getColorAt(hit.point, hit.footprint);
+
+        color[0] = coEfficients[0] * surfaceColor.x;
+        color[1] = coEfficients[0] * surfaceColor.y;
+        color[2] = coEfficients[0] * surfaceColor.z;
+
+        if ((int)(pointLights.size() + spotLights.size()) > exactLightLimit && !lightTree.empty()) {
+            sampleLights(ray, hit, surfaceColor, color);
+        } else {
+            for (const auto& light : pointLights) {
+                Vector3<double> lightDir = Vector3<double>(light.light_pos) - hit.point;
+                double lightDist = length(lightDir);
+                if (lightDist > lightRange) continue;
+                lightDir = lightDir * (1.0 / lightDist);
+
+                addLight(ray, hit, surfaceColor, light, lightDir, lightDist, color);
+            }
+
+            for (const auto& light : spotLights) {
+                Vector3<double> lightDir = Vector3<double>(light.light_pos) - hit.point;
+                double lightDist = length(lightDir);
+                if (lightDist > lightRange) continue;
+                lightDir = lightDir * (1.0 / lightDist);
+
+                if (!spotCovers(light, lightDir)) {
+                    stats.coneSkippedRays++;
+                    continue;
+                }
+
+                addLight(ray, hit, surfaceColor, light, lightDir, lightDist, color);
+            }
+
+            if (object->roughness > 0) {
+                for (const auto& light : pointLights) {
+                    addFresnelSpecular(ray, hit, light, 1.0, color);
+                }
+            }
+        }
+    }
+
+    void addLight(Ray* ray, const HitRecord& hit, const Vector3<double>& surfaceColor, const PointLight& light,
+                  const Vector3<double>& lightDir, double lightDist, double* color, double weight = 1.0) {
+        const Object* object = hit.object;
+        const Vector3<double>& normal = hit.normal;
+
+        double lambert = std::max<double>(0.0, dot(normal, lightDir)) * weight;
+        Vector3<double> reflectDir = reflect(lightDir, normal);
+        double phong = std::max<double>(0.0, -dot(ray->dir, reflectDir));
+        phong = pow(phong, object->shine) * weight;
+        if (lambert <= 0 && phong <= 0) {
+            stats.backfaceSkippedRays++;
+            return;
+        }
+
+        Ray shadowRay(hit.point + lightDir * rayOffset(hit.point), lightDir, lightDist);
+        bool inShadow;
+        stats.shadowRays++;
+        {
+            ScopedTimer timer(timed ? &stats.shadowTime : nullptr);
+            inShadow = sceneBVH.occluded(&shadowRay, &stats);
+        }
+        if (inShadow) return;
+
+        color[0] += object->coEfficients[1] * light.color[0] * lambert * surfaceColor.x;
+        color[1] += object->coEfficients[1] * light.color[1] * lambert * surfaceColor.y;
+        color[2] += object->coEfficients[1] * light.color[2] * lambert * surfaceColor.z;
+
+        color[0] += object->coEfficients[2] * light.color[0] * phong;
+        color[1] += object->coEfficients[2] * light.color[1] * phong;
+        color[2] += object->coEfficients[2] * light.color[2] * phong;
+    }
+
+    // Spreads lightSamplesPerHit shadow rays over the lights drawn from the
+    // light tree, each weighted by the inverse of its selection probability.
+    void sampleLights(Ray* ray, const HitRecord& hit, const Vector3<double>& surfaceColor, double* color) {
+        uint64_t state = hashPoint(hit.point);
+        for (int s = 0; s < lightSamplesPerHit; s++) {
+            double pdf;
+            int entry = lightTree.sample(hit.point, hit.normal, nextUniform(state), pdf);
+            if (entry < 0) continue;
+            double weight = 1.0 / (lightSamplesPerHit * pdf);
+            const PointLight& light = LightTree::lightAt(entry);
+            bool spot = entry >= (int)pointLights.size();
+
+            Vector3<double> lightDir = Vector3<double>(light.light_pos) - hit.point;
+            double lightDist = length(lightDir);
+            if (lightDist > lightRange) continue;
+            lightDir = lightDir * (1.0 / lightDist);
+
+            if (spot && !spotCovers(spotLights[entry - pointLights.size()], lightDir)) {
+                stats.coneSkippedRays++;
+                continue;
+            }
+
+            addLight(ray, hit, surfaceColor, light, lightDir, lightDist, color, weight);
+            if (!spot && hit.object->roughness > 0) {
+                addFresnelSpecular(ray, hit, light, weight, color);
+            }
+        }
+    }
+
+    // The light choice is seeded from the hit point alone so a render does
+    // not depend on how pixels were spread over threads.
+    static uint64_t hashPoint(const Vector3<double>& point) {
+        double coords[3] = {point.x, point.y, point.z};
+        uint64_t bits[3];
+        memcpy(bits, coords, sizeof(bits));
+        return bits[0] ^ (bits[1] * 0x9E3779B97F4A7C15ULL) ^ (bits[2] * 0xC2B2AE3D27D4EB4FULL);
+    }
+
+    static uint64_t mixBits(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    static double nextUniform(uint64_t& state) {
+        state += 0x9E3779B97F4A7C15ULL;
+        return (mixBits(state) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    void addFresnelSpecular(Ray* ray, const HitRecord& hit, const PointLight& light, double weight, double* color) {
+        const Object* object = hit.object;
+        const Vector3<double>& normal = hit.normal;
+
+        Vector3<double> lightDir = Vector3<double>(light.light_pos) - hit.point;
+        double lightDist = length(lightDir);
+        if (lightDist > lightRange) return;
+        lightDir = lightDir * (1.0 / lightDist);
+
+        double fresnel = pow(1.0 - std::max<double>(0.0, dot(normal, lightDir)), 5.0);
+        fresnel = fresnel * (1.0 - object->metallic) + object->metallic;
+
+        Vector3<double> reflectDir = reflect(lightDir, normal);
+        double specular = pow(std::max<double>(0.0, -dot(ray->dir, reflectDir)), 1.0 / object->roughness);
+        specular *= weight;
+
+        color[0] += fresnel * specular * light.color[0];
+        color[1] += fresnel * specular * light.color[1];
+        color[2] += fresnel * specular * light.color[2];
+    }
+};
+
+class Sphere : public Object {
+public:
+    Sphere(Vector3D center, double radius) {
+        reference_point = center;
+        length = radius;
+        metallic = 0.5;
+        roughness = 0.5;
+    }
+
+    void draw() override {
+        glPushMatrix();
+        glColor3f(color[0], color[1], color[2]);
+        glTranslatef(reference_point.x, reference_point.y, reference_point.z);
+        glutSolidSphere(length, 50, 50);
+        glPopMatrix();
+    }
+
+    AABB getBounds() override {
+        Vector3D extent(length, length, length);
+        return AABB(reference_point - extent, reference_point + extent);
+    }
+
+    int getPrimitiveKind() override {
+        return PRIM_SPHERE;
+    }
+
+    void pack(PackedPrimitives& packed, int index) override {
+        packed.setSphere(index, reference_point, length);
+    }
+
+    bool occludes(Ray* ray) override {
+        Vector3<double> oc = ray->start - Vector3<double>(reference_point);
+        const Vector3<double>& d = ray->dir;
+        double b = dot(oc, d);
+        double c = lengthSquared(oc) - length * length;
+        if (c > 0 && b > 0) return false;
+
+        double a = dot(d, d);
+        double discriminant = a * (length * length - lengthSquared(oc - d * (b / a)));
+        if (discriminant < 0) return false;
+
+        double root = sqrt(discriminant);
+        double t1 = (-b - root) / a;
+        if (t1 > ray->tMin) return t1 < ray->tMax;
+        double t2 = (-b + root) / a;
+        return t2 > ray->tMin && t2 < ray->tMax;
+    }
+
+    Vector3<double> getNormal(const Vector3<double>& point, int part = -1) override {
+        Vector3<double> normal = point - Vector3<double>(reference_point);
+        normal = normalize(normal);
+        return normal;
+    }
+
+    // Taken from the closest approach, like sphereKernel, so the result
+    // holds at silhouettes and far from the origin.
+    double intersect(Ray* ray) override {
+        Vector3<double> oc = ray->start - Vector3<double>(reference_point);
+        const Vector3<double>& d = ray->dir;
+        double a = dot(d, d);
+        double b = dot(oc, d);
+        double discriminant = a * (length * length - lengthSquared(oc - d * (b / a)));
+
+        if (discriminant < 0) return -1.0;
+
+        double t1 = (-b - sqrt(discriminant)) / a;
+        double t2 = (-b + sqrt(discriminant)) / a;
+
+        double t = (t1 > ray->tMin) ? t1 : ((t2 > ray->tMin) ? t2 : -1.0);
+        if (t < 0) return -1.0;
 
         return t;
     }
@@ -228,8 +1475,13 @@ public:
 class Triangle : public Object {
 public:
     Vector3D points[3];
+    Vector3D edge1, edge2, normal;
+
     Triangle(Vector3D p1, Vector3D p2, Vector3D p3) {
         points[0] = p1; points[1] = p2; points[2] = p3;
+        edge1 = points[1] - points[0];
+        edge2 = points[2] - points[0];
+        normal = normalize(cross(edge1, edge2));
     }
 
     void draw() override {
@@ -241,137 +1493,187 @@ public:
         glEnd();
     }
 
-    double intersect(Ray* ray, double* color, int level) override {
-        Vector3D edge1 = points[1] - points[0];
-        Vector3D edge2 = points[2] - points[0];
-        Vector3D h = {ray->dir.y * edge2.z - ray->dir.z * edge2.y,
-                      ray->dir.z * edge2.x - ray->dir.x * edge2.z,
-                      ray->dir.x * edge2.y - ray->dir.y * edge2.x};
-        double a = edge1.x * h.x + edge1.y * h.y + edge1.z * h.z;
+    AABB getBounds() override {
+        AABB box;
+        box.expand(points[0]);
+        box.expand(points[1]);
+        box.expand(points[2]);
+        return box;
+    }
 
-        if (fabs(a) < 1e-6) return -1.0;
+    int getPrimitiveKind() override {
+        return PRIM_TRIANGLE;
+    }
 
-        double f = 1.0 / a;
-        Vector3D s = ray->start - points[0];
-        double u = f * (s.x * h.x + s.y * h.y + s.z * h.z);
-        if (u < 0.0 || u > 1.0) return -1.0;
+    void pack(PackedPrimitives& packed, int index) override {
+        packed.setTriangle(index, points[0], points[1], points[2]);
+    }
 
-        Vector3D q = {s.y * edge1.z - s.z * edge1.y,
-                      s.z * edge1.x - s.x * edge1.z,
-                      s.x * edge1.y - s.y * edge1.x};
-        double v = f * (ray->dir.x * q.x + ray->dir.y * q.y + ray->dir.z * q.z);
-        if (v < 0.0 || u + v > 1.0) return -1.0;
+    bool occludes(Ray* ray) override {
+        double t = intersect(ray);
+        return t > ray->tMin && t < ray->tMax;
+    }
 
-        double t = f * (edge2.x * q.x + edge2.y * q.y + edge2.z * q.z);
-        if (t < 0) return -1.0;
+    Vector3<double> getNormal(const Vector3<double>& point, int part = -1) override {
+        return Vector3<double>(normal);
+    }
 
-        if (level == 0) return t;
-
-        Vector3D intersectionPoint = ray->start + ray->dir * t;
-        Vector3D normal = {edge1.y * edge2.z - edge1.z * edge2.y,
-                           edge1.z * edge2.x - edge1.x * edge2.z,
-                           edge1.x * edge2.y - edge1.y * edge2.x};
-        double magnitude = sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
-        normal.x /= magnitude;
-        normal.y /= magnitude;
-        normal.z /= magnitude;
-
-        color[0] = coEfficients[0] * this->color[0];
-        color[1] = coEfficients[0] * this->color[1];
-        color[2] = coEfficients[0] * this->color[2];
-
-        for (const auto& light : pointLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
-
-            Ray shadowRay(intersectionPoint + lightDir * 1e-6, lightDir);
-            bool inShadow = false;
-            for (const auto& obj : objects) {
-                double shadowT = obj->intersect(&shadowRay, nullptr, 0);
-                if (shadowT > 0 && shadowT < lightDist) {
-                    inShadow = true;
-                    break;
-                }
-            }
+    // Branch-free Moller-Trumbore on the precomputed edges; random rays
+    // mispredict the early-out version's barycentric tests about half the time.
+    double intersect(Ray* ray) override {
+        return triangleKernel<ScalarLanes>(ray->start.x, ray->start.y, ray->start.z, ray->dir.x, ray->dir.y, ray->dir.z,
+                                           points[0].x, points[0].y, points[0].z,
+                                           edge1.x, edge1.y, edge1.z, edge2.x, edge2.y, edge2.z);
+    }
+};
 
-            if (inShadow) continue;
+// An indexed triangle mesh that enters the scene BVH as a single object.
+// Vertices are shared between faces; each triangle only stores its three
+// position indices (plus optional normal indices from OBJ files) and its
+// precomputed vertex/edge data, packed in the mesh's own BVH order.
+class Mesh : public Object {
+public:
+    std::vector<Vector3D> positions;
+    std::vector<Vector3D> normals;
+    std::vector<int> indices;
+    std::vector<int> normalIndices;
+
+    std::vector<BVHNode> nodes;
+    PackedPrimitives packed;
 
-            double lambert = std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z);
-            color[0] += coEfficients[1] * light.color[0] * lambert * this->color[0];
-            color[1] += coEfficients[1] * light.color[1] * lambert * this->color[1];
-            color[2] += coEfficients[1] * light.color[2] * lambert * this->color[2];
+    int triangleCount() const {
+        return (int)indices.size() / 3;
+    }
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double phong = std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z));
-            phong = pow(phong, shine);
-            color[0] += coEfficients[2] * light.color[0] * phong;
-            color[1] += coEfficients[2] * light.color[1] * phong;
-            color[2] += coEfficients[2] * light.color[2] * phong;
+    void build() {
+        int count = triangleCount();
+        std::vector<AABB> bounds(count);
+        for (int i = 0; i < count; i++) {
+            for (int k = 0; k < 3; k++) bounds[i].expand(positions[indices[3 * i + k]]);
         }
 
-        for (const auto& light : spotLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
+        std::vector<int> order = BVH::buildNodes(bounds, nodes);
+        reorder(indices, order);
+        reorder(normalIndices, order);
 
-            double cosTheta = -(lightDir.x * light.light_direction.x + lightDir.y * light.light_direction.y + lightDir.z * light.light_direction.z);
-            if (acos(cosTheta) * 180.0 / M_PI > light.cutoff_angle) continue;
+        packed.watertight = watertightTriangles;
+        packed.resize(count);
+        for (int i = 0; i < count; i++) {
+            packed.setTriangle(i, positions[indices[3 * i]], positions[indices[3 * i + 1]], positions[indices[3 * i + 2]]);
+        }
+        for (auto& node : nodes) {
+            node.sphereCount = 0;
+            node.triangleCount = node.count;
+        }
+    }
 
-            Ray shadowRay(intersectionPoint + lightDir * 1e-6, lightDir);
-            bool inShadow = false;
-            for (const auto& obj : objects) {
-                double shadowT = obj->intersect(&shadowRay, nullptr, 0);
-                if (shadowT > 0 && shadowT < lightDist) {
-                    inShadow = true;
-                    break;
-                }
-            }
+    void draw() override {
+        glBegin(GL_TRIANGLES);
+        glColor3f(color[0], color[1], color[2]);
+        for (int index : indices) {
+            glVertex3f(positions[index].x, positions[index].y, positions[index].z);
+        }
+        glEnd();
+    }
 
-            if (inShadow) continue;
+    AABB getBounds() override {
+        return nodes.empty() ? AABB() : nodes[0].bounds;
+    }
 
-            double lambert = std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z);
-            color[0] += coEfficients[1] * light.color[0] * lambert * this->color[0];
-            color[1] += coEfficients[1] * light.color[1] * lambert * this->color[1];
-            color[2] += coEfficients[1] * light.color[2] * lambert * this->color[2];
+    int getPrimitiveKind() override {
+        return PRIM_MESH;
+    }
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double phong = std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z));
-            phong = pow(phong, shine);
-            color[0] += coEfficients[2] * light.color[0] * phong;
-            color[1] += coEfficients[2] * light.color[1] * phong;
-            color[2] += coEfficients[2] * light.color[2] * phong;
-        }
+    double intersectPart(Ray* ray, int& part, RenderStats* counters = nullptr) override {
+        double tNearest = ray->tMax;
+        long long tested = 0, hits = 0;
+        part = -1;
+        BVH::traverseNearest(nodes, *ray, tNearest, [&](const BVHNode& node) {
+            hits += intersectPacked<PRIM_TRIANGLE>(packed, node.leftFirst, node.count, *ray, tNearest, part);
+            tested += node.count;
+        });
+        if (counters) counters->countTests(PRIM_MESH, tested, hits);
+        return part >= 0 ? tNearest : -1.0;
+    }
 
-        if (level >= recursionLevel) return t;
+    double intersect(Ray* ray) override {
+        int part;
+        return intersectPart(ray, part);
+    }
 
-        Vector3D reflectDir = ray->dir - normal * (2.0 * (ray->dir.x * normal.x + ray->dir.y * normal.y + ray->dir.z * normal.z));
-        Ray reflectedRay(intersectionPoint + reflectDir * 1e-6, reflectDir);
+    bool occludes(Ray* ray) override {
+        return occludesCounted(ray, nullptr);
+    }
 
-        double reflectedColor[3] = {0, 0, 0};
-        double tMin = 1e9;
-        Object* nearestObject = nullptr;
+    bool occludesCounted(Ray* ray, RenderStats* counters) override {
+        int tested = 0;
+        bool blocked = BVH::traverseAny(nodes, *ray, [&](const BVHNode& node) {
+            return occludedPacked<PRIM_TRIANGLE>(packed, node.leftFirst, node.count, *ray, tested);
+        });
+        if (counters) counters->countTests(PRIM_MESH, tested, blocked);
+        return blocked;
+    }
 
-        for (const auto& obj : objects) {
-            double t = obj->intersect(&reflectedRay, reflectedColor, level + 1);
-            if (t > 0 && t < tMin) {
-                tMin = t;
-                nearestObject = obj;
+    Vector3<double> getNormal(const Vector3<double>& point, int part = -1) override {
+        if (part < 0) return Vector3<double>(0, 0, 1);
+
+        Vector3<double> edge1(packed.edge1(part));
+        Vector3<double> edge2(packed.edge2(part));
+        Vector3<double> normal = cross(edge1, edge2);
+
+        int n0, n1, n2;
+        if (normalCorners(part, n0, n1, n2)) {
+            // Barycentric weights of the hit point inside the triangle.
+            Vector3<double> offset = point - Vector3<double>(packed.vertex(part));
+            double d00 = lengthSquared(edge1);
+            double d01 = dot(edge1, edge2);
+            double d11 = lengthSquared(edge2);
+            double d20 = dot(offset, edge1);
+            double d21 = dot(offset, edge2);
+            double denom = d00 * d11 - d01 * d01;
+            if (fabs(denom) > 1e-18) {
+                double b1 = (d11 * d20 - d01 * d21) / denom;
+                double b2 = (d00 * d21 - d01 * d20) / denom;
+                double b0 = 1.0 - b1 - b2;
+                Vector3<double> shading = Vector3<double>(normals[n0]) * b0 + Vector3<double>(normals[n1]) * b1 + Vector3<double>(normals[n2]) * b2;
+                if (lengthSquared(shading) > 1e-18) normal = shading;
             }
         }
 
-        if (nearestObject) {
-            nearestObject->intersect(&reflectedRay, reflectedColor, level + 1);
-            color[0] += reflectedColor[0] * coEfficients[3];
-            color[1] += reflectedColor[1] * coEfficients[3];
-            color[2] += reflectedColor[2] * coEfficients[3];
+        normal = normalize(normal);
+        return normal;
+    }
+
+private:
+    // Normals are indexed per corner when the file supplied separate normal
+    // indices (OBJ), otherwise per vertex (PLY). -1 marks a corner without one.
+    bool normalCorners(int triangle, int& n0, int& n1, int& n2) const {
+        if (normals.empty()) return false;
+        const std::vector<int>& source = normalIndices.empty() ? indices : normalIndices;
+        n0 = source[3 * triangle];
+        n1 = source[3 * triangle + 1];
+        n2 = source[3 * triangle + 2];
+        int size = (int)normals.size();
+        return n0 >= 0 && n1 >= 0 && n2 >= 0 && n0 < size && n1 < size && n2 < size;
+    }
+
+    static void reorder(std::vector<int>& corners, const std::vector<int>& order) {
+        if (corners.empty()) return;
+        std::vector<int> sorted;
+        sorted.reserve(corners.size());
+        for (int triangle : order) {
+            sorted.insert(sorted.end(), corners.begin() + 3 * triangle, corners.begin() + 3 * triangle + 3);
         }
+        corners.swap(sorted);
+    }
+};
 
-        return t;
+struct TextureLevel {
+    int width, height;
+    std::vector<float> texels;
+
+    const float* texel(int x, int y) const {
+        return &texels[3 * (y * width + x)];
     }
 };
 
@@ -379,35 +1681,40 @@ class Floor : public Object {
 public:
     double floorWidth, tileWidth;
     bool useTexture;
-    unsigned char* textureData;
-    int textureWidth, textureHeight, textureChannels;
+    int textureWidth, textureHeight;
+    std::vector<TextureLevel> mipLevels;
+
+    static constexpr double TEXTURE_REPEAT = 10.0;
 
     Floor(double floorWidth, double tileWidth, const std::string& textureFile = "") {
         this->floorWidth = floorWidth;
         this->tileWidth = tileWidth;
         this->useTexture = false;
 
-        loadTextureFromFile();
+        loadTextureFromFile(textureFile.empty() ? "texture2.bmp" : textureFile);
     }
 
-    void loadTextureFromFile() {
-        textureData = stbi_load("texture2.bmp", &textureWidth, &textureHeight, &textureChannels, 0);
-        
-        if (!textureData) {
-            std::cerr << "Warning: Could not load texture2.bmp, generating fallback texture" << std::endl;
+    void loadTextureFromFile(const std::string& textureFile) {
+        int channels;
+        unsigned char* data = stbi_load(textureFile.c_str(), &textureWidth, &textureHeight, &channels, 0);
+
+        if (!data) {
+            std::cerr << "Warning: Could not load " << textureFile << ", generating fallback texture" << std::endl;
             generateFallbackTexture();
         } else {
-            std::cout << "Successfully loaded texture2.bmp (" << textureWidth << "x" << textureHeight << ", " << textureChannels << " channels)" << std::endl;
+            std::cout << "Successfully loaded " << textureFile << " (" << textureWidth << "x" << textureHeight << ", " << channels << " channels)" << std::endl;
+            buildMipChain(data, channels);
+            stbi_image_free(data);
         }
     }
 
     void generateFallbackTexture() {
         textureWidth = 512;
         textureHeight = 512;
-        textureChannels = 3;
-        
-        textureData = new unsigned char[textureWidth * textureHeight * textureChannels];
-        
+        const int textureChannels = 3;
+
+        std::vector<unsigned char> textureData(textureWidth * textureHeight * textureChannels);
+
         for (int y = 0; y < textureHeight; y++) {
             for (int x = 0; x < textureWidth; x++) {
                 int index = (y * textureWidth + x) * textureChannels;
@@ -437,6 +1744,43 @@ public:
                 }
             }
         }
+
+        buildMipChain(textureData.data(), textureChannels);
+    }
+
+    void buildMipChain(const unsigned char* data, int channels) {
+        mipLevels.clear();
+        if (textureWidth <= 0 || textureHeight <= 0) return;
+
+        TextureLevel base;
+        base.width = textureWidth;
+        base.height = textureHeight;
+        base.texels.resize(3 * textureWidth * textureHeight);
+        for (int i = 0; i < textureWidth * textureHeight; i++) {
+            for (int c = 0; c < 3; c++) {
+                base.texels[3 * i + c] = data[i * channels + (channels >= 3 ? c : 0)] / 255.0f;
+            }
+        }
+        mipLevels.push_back(base);
+
+        while (mipLevels.back().width > 1 || mipLevels.back().height > 1) {
+            const TextureLevel& source = mipLevels.back();
+            TextureLevel level;
+            level.width = std::max(1, source.width / 2);
+            level.height = std::max(1, source.height / 2);
+            level.texels.resize(3 * level.width * level.height);
+            for (int y = 0; y < level.height; y++) {
+                int y0 = std::min(2 * y, source.height - 1), y1 = std::min(2 * y + 1, source.height - 1);
+                for (int x = 0; x < level.width; x++) {
+                    int x0 = std::min(2 * x, source.width - 1), x1 = std::min(2 * x + 1, source.width - 1);
+                    for (int c = 0; c < 3; c++) {
+                        level.texels[3 * (y * level.width + x) + c] =
+                            0.25f * (source.texel(x0, y0)[c] + source.texel(x1, y0)[c] + source.texel(x0, y1)[c] + source.texel(x1, y1)[c]);
+                    }
+                }
+            }
+            mipLevels.push_back(std::move(level));
+        }
     }
 
     void hsvToRgb(double h, double s, double v, double& r, double& g, double& b) {
@@ -463,49 +1807,50 @@ public:
         b += m;
     }
 
-    Vector3D sampleTexture(double u, double v) {
-        if (!textureData || textureWidth <= 0 || textureHeight <= 0) {
-            return Vector3D(0.5, 0.5, 0.5);
+    Vector3<double> sampleLevel(int index, double u, double v) {
+        const TextureLevel& level = mipLevels[index];
+        double x = u * level.width - 0.5;
+        double y = (1.0 - v) * level.height - 0.5;
+        double fx = floor(x), fy = floor(y);
+        double ax = x - fx, ay = y - fy;
+
+        int x0 = ((int)fmod(fx, level.width) + level.width) % level.width;
+        int y0 = ((int)fmod(fy, level.height) + level.height) % level.height;
+        int x1 = (x0 + 1) % level.width;
+        int y1 = (y0 + 1) % level.height;
+
+        const float* t00 = level.texel(x0, y0);
+        const float* t10 = level.texel(x1, y0);
+        const float* t01 = level.texel(x0, y1);
+        const float* t11 = level.texel(x1, y1);
+
+        double color[3];
+        for (int c = 0; c < 3; c++) {
+            double top = t00[c] + (t10[c] - t00[c]) * ax;
+            double bottom = t01[c] + (t11[c] - t01[c]) * ax;
+            color[c] = top + (bottom - top) * ay;
         }
+        return Vector3<double>(color[0], color[1], color[2]);
+    }
 
-        double tilesPerFloor = 10.0;
-        
-        u = fmod(u * tilesPerFloor, 1.0);
-        v = fmod(v * tilesPerFloor, 1.0);
-        
-        if (u < 0) u += 1.0;
-        if (v < 0) v += 1.0;
-
-        u = std::max(0.0, std::min(1.0, u));
-        v = std::max(0.0, std::min(1.0, v));
-
-        int pixel_x = (int)(u * (textureWidth - 1));
-        int pixel_y = (int)((1.0 - v) * (textureHeight - 1));
-
-        pixel_x = std::max(0, std::min(textureWidth - 1, pixel_x));
-        pixel_y = std::max(0, std::min(textureHeight - 1, pixel_y));
-
-        int index = (pixel_y * textureWidth + pixel_x) * textureChannels;
-        int max_index = textureWidth * textureHeight * textureChannels;
-        if (index < 0 || index + 2 >= max_index) {
-            return Vector3D(1.0, 0.0, 1.0);
+    Vector3<double> sampleTexture(double u, double v, double footprint = 0) {
+        if (mipLevels.empty()) {
+            return Vector3<double>(0.5, 0.5, 0.5);
         }
 
-        Vector3D color;
-        color.x = textureData[index] / 255.0;
+        u *= TEXTURE_REPEAT;
+        v *= TEXTURE_REPEAT;
 
-        if (textureChannels >= 2) {
-            color.y = textureData[index + 1] / 255.0;
-        } else {
-            color.y = color.x;
-        }
+        double texelSize = floorWidth / (TEXTURE_REPEAT * mipLevels[0].width);
+        double lod = footprint > texelSize ? log2(footprint / texelSize) : 0.0;
+        lod = std::min(lod, (double)(mipLevels.size() - 1));
 
-        if (textureChannels >= 3) {
-            color.z = textureData[index + 2] / 255.0;
-        } else {
-            color.z = color.x;
+        int level = (int)lod;
+        double blend = lod - level;
+        Vector3<double> color = sampleLevel(level, u, v);
+        if (blend > 0 && level + 1 < (int)mipLevels.size()) {
+            color = color * (1.0 - blend) + sampleLevel(level + 1, u, v) * blend;
         }
-
         return color;
     }
 
@@ -517,11 +1862,11 @@ public:
         glBegin(GL_QUADS);
         for (double x = -floorWidth / 2; x < floorWidth / 2; x += tileWidth) {
             for (double y = -floorWidth / 2; y < floorWidth / 2; y += tileWidth) {
-                if (useTexture && textureData) {
-                    double u = (x + floorWidth / 2) / floorWidth;
-                    double v = (y + floorWidth / 2) / floorWidth;
-                    
-                    Vector3D texColor = sampleTexture(u, v);
+                if (useTexture && !mipLevels.empty()) {
+                    double u = (x + tileWidth / 2 + floorWidth / 2) / floorWidth;
+                    double v = (y + tileWidth / 2 + floorWidth / 2) / floorWidth;
+
+                    Vector3<double> texColor = sampleTexture(u, v, tileWidth);
                     glColor3f(texColor.x, texColor.y, texColor.z);
                 } else {
                     bool isWhite = (static_cast<int>((x + floorWidth / 2) / tileWidth) + static_cast<int>((y + floorWidth / 2) / tileWidth)) % 2 == 0;
@@ -537,146 +1882,86 @@ public:
         glEnd();
     }
 
-    ~Floor() {
-        if (textureData) {
-            delete[] textureData;
-        }
+    AABB getBounds() override {
+        return AABB(Vector3D(-floorWidth / 2, -floorWidth / 2, 0), Vector3D(floorWidth / 2, floorWidth / 2, 0));
     }
 
-    double intersect(Ray* ray, double* color, int level) override {
-        if (fabs(ray->dir.z) < 1e-6) return -1.0;
-
-        double t = -ray->start.z / ray->dir.z;
-        if (t < 0) return -1.0;
-
-        Vector3D intersectionPoint = ray->start + ray->dir * t;
-
-        if (intersectionPoint.x < -floorWidth / 2 || intersectionPoint.x > floorWidth / 2 ||
-            intersectionPoint.y < -floorWidth / 2 || intersectionPoint.y > floorWidth / 2) {
-            return -1.0;
-        }
-
-        if (level == 0) return t;
-
-        Vector3D intersectionPointColor;
-        if (useTexture && textureData) {
-            double u = (intersectionPoint.x + floorWidth / 2) / floorWidth;
-            double v = (intersectionPoint.y + floorWidth / 2) / floorWidth;
-            
-            intersectionPointColor = sampleTexture(u, v);
-        } else {
-            bool isWhite = (static_cast<int>((intersectionPoint.x + floorWidth / 2) / tileWidth) + 
-                           static_cast<int>((intersectionPoint.y + floorWidth / 2) / tileWidth)) % 2 == 0;
-            intersectionPointColor.x = intersectionPointColor.y = intersectionPointColor.z = isWhite ? 1.0 : 0.0;
-        }
-
-        Vector3D normal(0, 0, 1);
-
-        color[0] = coEfficients[0] * intersectionPointColor.x;
-        color[1] = coEfficients[0] * intersectionPointColor.y;
-        color[2] = coEfficients[0] * intersectionPointColor.z;
-
-        for (const auto& light : pointLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
-
-            Ray shadowRay(intersectionPoint + lightDir * 1e-6, lightDir);
-            bool inShadow = false;
-            for (const auto& obj : objects) {
-                double shadowT = obj->intersect(&shadowRay, nullptr, 0);
-                if (shadowT > 0 && shadowT < lightDist) {
-                    inShadow = true;
-                    break;
-                }
-            }
-
-            if (inShadow) continue;
-
-            double lambert = std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z);
-            color[0] += coEfficients[1] * light.color[0] * lambert * intersectionPointColor.x;
-            color[1] += coEfficients[1] * light.color[1] * lambert * intersectionPointColor.y;
-            color[2] += coEfficients[1] * light.color[2] * lambert * intersectionPointColor.z;
+    int getPrimitiveKind() override {
+        return PRIM_FLOOR;
+    }
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double phong = std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z));
-            phong = pow(phong, shine);
-            color[0] += coEfficients[2] * light.color[0] * phong;
-            color[1] += coEfficients[2] * light.color[1] * phong;
-            color[2] += coEfficients[2] * light.color[2] * phong;
-        }
+    bool occludes(Ray* ray) override {
+        if (fabs(ray->dir.z) < 1e-6) return false;
 
-        for (const auto& light : spotLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
+        double t = -ray->start.z * ray->invDir.z;
+        if (t <= ray->tMin || t >= ray->tMax) return false;
 
-            double cosTheta = -(lightDir.x * light.light_direction.x + lightDir.y * light.light_direction.y + lightDir.z * light.light_direction.z);
-            if (acos(cosTheta) * 180.0 / M_PI > light.cutoff_angle) continue;
+        double x = ray->start.x + ray->dir.x * t;
+        double y = ray->start.y + ray->dir.y * t;
+        return x >= -floorWidth / 2 && x <= floorWidth / 2 && y >= -floorWidth / 2 && y <= floorWidth / 2;
+    }
 
-            Ray shadowRay(intersectionPoint + lightDir * 1e-6, lightDir);
-            bool inShadow = false;
-            for (const auto& obj : objects) {
-                double shadowT = obj->intersect(&shadowRay, nullptr, 0);
-                if (shadowT > 0 && shadowT < lightDist) {
-                    inShadow = true;
-                    break;
-                }
-            }
 
-            if (inShadow) continue;
+    Vector3<double> getNormal(const Vector3<double>& point, int part = -1) override {
+        return Vector3<double>(0, 0, 1);
+    }
 
-            double lambert = std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z);
-            color[0] += coEfficients[1] * light.color[0] * lambert * intersectionPointColor.x;
-            color[1] += coEfficients[1] * light.color[1] * lambert * intersectionPointColor.y;
-            color[2] += coEfficients[1] * light.color[2] * lambert * intersectionPointColor.z;
+    Vector3<double> getColorAt(const Vector3<double>& point, double footprint = 0) override {
+        Vector3<double> intersectionPointColor;
+        if (useTexture && !mipLevels.empty()) {
+            double u = (point.x + floorWidth / 2) / floorWidth;
+            double v = (point.y + floorWidth / 2) / floorWidth;
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double phong = std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z));
-            phong = pow(phong, shine);
-            color[0] += coEfficients[2] * light.color[0] * phong;
-            color[1] += coEfficients[2] * light.color[1] * phong;
-            color[2] += coEfficients[2] * light.color[2] * phong;
+            intersectionPointColor = sampleTexture(u, v, footprint);
+        } else {
+            bool isWhite = (static_cast<int>((point.x + floorWidth / 2) / tileWidth) +
+                           static_cast<int>((point.y + floorWidth / 2) / tileWidth)) % 2 == 0;
+            intersectionPointColor.x = intersectionPointColor.y = intersectionPointColor.z = isWhite ? 1.0 : 0.0;
         }
+        return intersectionPointColor;
+    }
 
-        if (level >= recursionLevel) return t;
-
-        Vector3D reflectDir = ray->dir - normal * (2.0 * (ray->dir.x * normal.x + ray->dir.y * normal.y + ray->dir.z * normal.z));
-        Ray reflectedRay(intersectionPoint + reflectDir * 1e-6, reflectDir);
+    double intersect(Ray* ray) override {
+        if (fabs(ray->dir.z) < 1e-6) return -1.0;
 
-        double reflectedColor[3] = {0, 0, 0};
-        double tMin = 1e9;
-        Object* nearestObject = nullptr;
+        double t = -ray->start.z / ray->dir.z;
+        if (t <= ray->tMin) return -1.0;
 
-        for (const auto& obj : objects) {
-            double t = obj->intersect(&reflectedRay, reflectedColor, level + 1);
-            if (t > 0 && t < tMin) {
-                tMin = t;
-                nearestObject = obj;
-            }
-        }
+        Vector3<double> intersectionPoint = ray->start + ray->dir * t;
 
-        if (nearestObject) {
-            nearestObject->intersect(&reflectedRay, reflectedColor, level + 1);
-            color[0] += reflectedColor[0] * coEfficients[3];
-            color[1] += reflectedColor[1] * coEfficients[3];
-            color[2] += reflectedColor[2] * coEfficients[3];
+        if (intersectionPoint.x < -floorWidth / 2 || intersectionPoint.x > floorWidth / 2 ||
+            intersectionPoint.y < -floorWidth / 2 || intersectionPoint.y > floorWidth / 2) {
+            return -1.0;
         }
 
         return t;
     }
 };
 
+enum QuadricShape {
+    QUADRIC_SPHERE,
+    QUADRIC_ELLIPSOID,
+    QUADRIC_CYLINDER,
+    QUADRIC_CONE,
+    QUADRIC_PLANE,
+    QUADRIC_GENERAL
+};
+
 class General : public Object {
 public:
     double A, B, C, D, E, F, G, H, I, J;
     Vector3D cubeReferencePoint;
     double length, width, height;
 
+    // Set by classify(). Axis-aligned shapes are kept as
+    // sum(weight[i] * (p[i] - center[i])^2) = level with level >= 0; a zero
+    // weight is a cylinder's axis. Planes use (G, H, I) . p + J = 0.
+    int shape;
+    Vector3D center;
+    double weight[3];
+    double level;
+    AABB cullBox;
+
     General(double A, double B, double C, double D, double E, double F, double G, double H, double I, double J,
             Vector3D cubeReferencePoint, double length, double width, double height) {
         this->A = A; this->B = B; this->C = C; this->D = D; this->E = E;
@@ -685,6 +1970,66 @@ public:
         this->length = length;
         this->width = width;
         this->height = height;
+        classify();
+        cullBox = getBounds();
+        double pad = 1e-4;
+        cullBox.min = cullBox.min - Vector3D(pad, pad, pad);
+        cullBox.max = cullBox.max + Vector3D(pad, pad, pad);
+    }
+
+    void classify() {
+        shape = QUADRIC_GENERAL;
+        center = Vector3D(0, 0, 0);
+        weight[0] = A; weight[1] = B; weight[2] = C;
+        level = 0;
+
+        double scale = 0;
+        for (double k : {A, B, C, D, E, F, G, H, I, J}) scale = std::max(scale, fabs(k));
+        double eps = 1e-12 * scale;
+        if (fabs(D) > eps || fabs(E) > eps || fabs(F) > eps) return;
+
+        double linear[3] = {G, H, I};
+        if (fabs(A) <= eps && fabs(B) <= eps && fabs(C) <= eps) {
+            if (fabs(G) > eps || fabs(H) > eps || fabs(I) > eps) shape = QUADRIC_PLANE;
+            return;
+        }
+
+        // Complete the square on every axis that has a squared term; a linear
+        // term on an axis without one is a paraboloid and stays general.
+        double c[3] = {0, 0, 0};
+        double magnitude = fabs(J);
+        level = -J;
+        int positive = 0, negative = 0;
+        for (int i = 0; i < 3; i++) {
+            if (fabs(weight[i]) <= eps) {
+                if (fabs(linear[i]) > eps) return;
+                weight[i] = 0;
+                continue;
+            }
+            c[i] = -linear[i] / (2 * weight[i]);
+            level += weight[i] * c[i] * c[i];
+            magnitude += fabs(weight[i] * c[i] * c[i]);
+            if (weight[i] > 0) positive++;
+            else negative++;
+        }
+        center = Vector3D(c[0], c[1], c[2]);
+
+        if (level < 0) {
+            level = -level;
+            for (double& w : weight) w = -w;
+            std::swap(positive, negative);
+        }
+        bool levelZero = level <= 1e-9 * magnitude;
+
+        if (positive == 3 && !levelZero) {
+            bool round = fabs(weight[0] - weight[1]) <= eps && fabs(weight[0] - weight[2]) <= eps;
+            shape = round ? QUADRIC_SPHERE : QUADRIC_ELLIPSOID;
+        } else if (positive == 2 && negative == 0 && !levelZero) {
+            shape = QUADRIC_CYLINDER;
+        } else if (positive + negative == 3 && positive > 0 && negative > 0 && levelZero) {
+            level = 0;
+            shape = QUADRIC_CONE;
+        }
     }
 
     void draw() override {
@@ -696,145 +2041,228 @@ public:
         glPopMatrix();
     }
 
-    double intersect(Ray* ray, double* color, int level) override {
-        double dx = ray->dir.x, dy = ray->dir.y, dz = ray->dir.z;
-        double ox = ray->start.x, oy = ray->start.y, oz = ray->start.z;
-
-        double a = A * dx * dx + B * dy * dy + C * dz * dz + D * dx * dy + E * dx * dz + F * dy * dz;
-        double b = 2 * (A * ox * dx + B * oy * dy + C * oz * dz) + D * (ox * dy + oy * dx) + E * (ox * dz + oz * dx) + F * (oy * dz + oz * dy) + G * dx + H * dy + I * dz;
-        double c = A * ox * ox + B * oy * oy + C * oz * oz + D * ox * oy + E * ox * oz + F * oy * oz + G * ox + H * oy + I * oz + J;
+    AABB getBounds() override {
+        AABB box = AABB::infinite();
+        double inf = std::numeric_limits<double>::infinity();
+        double c[3] = {center.x, center.y, center.z};
+        double extent[3] = {inf, inf, inf};
+        AABB clip = clipBox();
 
-        double discriminant = b * b - 4 * a * c;
-        if (discriminant < 0) return -1.0;
-
-        double t1 = (-b - sqrt(discriminant)) / (2.0 * a);
-        double t2 = (-b + sqrt(discriminant)) / (2.0 * a);
+        if (shape == QUADRIC_SPHERE || shape == QUADRIC_ELLIPSOID || shape == QUADRIC_CYLINDER) {
+            for (int i = 0; i < 3; i++) {
+                if (weight[i] > 0) extent[i] = sqrt(level / weight[i]);
+            }
+        } else if (shape == QUADRIC_CONE) {
+            // The odd-signed axis runs along the cone; once the clip box
+            // bounds it, the radius on the other two axes is bounded too.
+            int axis = 0;
+            for (int i = 0; i < 3; i++) {
+                int others = 0;
+                for (int k = 0; k < 3; k++) others += (k != i && (weight[k] > 0) == (weight[i] > 0));
+                if (others == 0) axis = i;
+            }
+            double lo = axisOf(clip.min, axis) - c[axis], hi = axisOf(clip.max, axis) - c[axis];
+            double reach = std::max(fabs(lo), fabs(hi));
+            for (int i = 0; i < 3; i++) {
+                if (i != axis) extent[i] = reach * sqrt(fabs(weight[axis] / weight[i]));
+            }
+        } else if (shape == QUADRIC_PLANE) {
+            // Where the clip box bounds two axes, the plane bounds the third
+            // between its values at the four corners.
+            double linear[3] = {G, H, I};
+            for (int i = 0; i < 3; i++) {
+                int u = (i + 1) % 3, v = (i + 2) % 3;
+                if (linear[i] == 0) continue;
+                double uRange[2] = {axisOf(clip.min, u), axisOf(clip.max, u)};
+                double vRange[2] = {axisOf(clip.min, v), axisOf(clip.max, v)};
+                if (linear[u] != 0 && !(std::isfinite(uRange[0]) && std::isfinite(uRange[1]))) continue;
+                if (linear[v] != 0 && !(std::isfinite(vRange[0]) && std::isfinite(vRange[1]))) continue;
+
+                double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+                for (double pu : uRange) {
+                    for (double pv : vRange) {
+                        double value = -(J + (linear[u] != 0 ? linear[u] * pu : 0) + (linear[v] != 0 ? linear[v] * pv : 0)) / linear[i];
+                        lo = std::min(lo, value);
+                        hi = std::max(hi, value);
+                    }
+                }
+                c[i] = 0.5 * (lo + hi);
+                extent[i] = 0.5 * (hi - lo);
+            }
+        } else {
+            box = generalBounds();
+        }
 
-        auto isInsideBoundingBox = [&](double t) {
-            if (t < 0) return false;
-            Vector3D p = ray->start + ray->dir * t;
-            if (length > 0 && (p.x < cubeReferencePoint.x || p.x > cubeReferencePoint.x + length)) return false;
-            if (width > 0 && (p.y < cubeReferencePoint.y || p.y > cubeReferencePoint.y + width)) return false;
-            if (height > 0 && (p.z < cubeReferencePoint.z || p.z > cubeReferencePoint.z + height)) return false;
-            return true;
-        };
+        if (shape != QUADRIC_GENERAL) {
+            box = AABB(Vector3D(c[0] - extent[0], c[1] - extent[1], c[2] - extent[2]),
+                       Vector3D(c[0] + extent[0], c[1] + extent[1], c[2] + extent[2]));
+        }
+        box.min = componentMax(box.min, clip.min);
+        box.max = componentMin(box.max, clip.max);
+        return box;
+    }
 
-        bool t1Valid = isInsideBoundingBox(t1);
-        bool t2Valid = isInsideBoundingBox(t2);
+    int getPrimitiveKind() override {
+        return PRIM_GENERAL;
+    }
 
-        double t = -1;
-        if (t1Valid && t2Valid) t = std::min(t1, t2);
-        else if (t1Valid) t = t1;
-        else if (t2Valid) t = t2;
-        if (t < 0) return -1.0;
+    bool isInsideBoundingBox(Ray* ray, double t) {
+        if (!(t > ray->tMin) || !std::isfinite(t)) return false;
+        Vector3<double> p = ray->start + ray->dir * t;
+        if (length > 0 && (p.x < cubeReferencePoint.x || p.x > cubeReferencePoint.x + length)) return false;
+        if (width > 0 && (p.y < cubeReferencePoint.y || p.y > cubeReferencePoint.y + width)) return false;
+        if (height > 0 && (p.z < cubeReferencePoint.z || p.z > cubeReferencePoint.z + height)) return false;
+        return true;
+    }
 
-        if (level == 0) return t;
+    bool occludes(Ray* ray) override {
+        double t = nearestRoot(ray);
+        return t > ray->tMin && t < ray->tMax;
+    }
 
-        Vector3D intersectionPoint = ray->start + ray->dir * t;
-        Vector3D normal = {
-            2 * A * intersectionPoint.x + D * intersectionPoint.y + E * intersectionPoint.z + G,
-            2 * B * intersectionPoint.y + D * intersectionPoint.x + F * intersectionPoint.z + H,
-            2 * C * intersectionPoint.z + E * intersectionPoint.x + F * intersectionPoint.y + I
+    Vector3<double> getNormal(const Vector3<double>& point, int part = -1) override {
+        Vector3<double> normal = {
+            2 * A * point.x + D * point.y + E * point.z + G,
+            2 * B * point.y + D * point.x + F * point.z + H,
+            2 * C * point.z + E * point.x + F * point.y + I
         };
-        double magnitude = sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
-        normal.x /= magnitude;
-        normal.y /= magnitude;
-        normal.z /= magnitude;
-
-        color[0] = coEfficients[0] * this->color[0];
-        color[1] = coEfficients[0] * this->color[1];
-        color[2] = coEfficients[0] * this->color[2];
-
-        for (const auto& light : pointLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
-
-            Ray shadowRay(intersectionPoint + lightDir * 1e-6, lightDir);
-            bool inShadow = false;
-            for (const auto& obj : objects) {
-                if (obj->intersect(&shadowRay, color, 0) > 0 && obj->intersect(&shadowRay, color, 0) < lightDist) {
-                    inShadow = true;
-                    break;
-                }
-            }
+        normal = normalize(normal);
+        return normal;
+    }
 
-            if (inShadow) continue;
+    double intersect(Ray* ray) override {
+        return nearestRoot(ray);
+    }
 
-            double lambert = std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z);
-            color[0] += coEfficients[1] * light.color[0] * lambert * this->color[0];
-            color[1] += coEfficients[1] * light.color[1] * lambert * this->color[1];
-            color[2] += coEfficients[1] * light.color[2] * lambert * this->color[2];
+private:
+    static double axisOf(const Vector3D& v, int axis) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double phong = std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z));
-            phong = pow(phong, shine);
-            color[0] += coEfficients[2] * light.color[0] * phong;
-            color[1] += coEfficients[2] * light.color[1] * phong;
-            color[2] += coEfficients[2] * light.color[2] * phong;
+    AABB clipBox() const {
+        AABB clip = AABB::infinite();
+        if (length > 0) {
+            clip.min.x = cubeReferencePoint.x;
+            clip.max.x = cubeReferencePoint.x + length;
         }
+        if (width > 0) {
+            clip.min.y = cubeReferencePoint.y;
+            clip.max.y = cubeReferencePoint.y + width;
+        }
+        if (height > 0) {
+            clip.min.z = cubeReferencePoint.z;
+            clip.max.z = cubeReferencePoint.z + height;
+        }
+        return clip;
+    }
 
-        for (const auto& light : spotLights) {
-            Vector3D lightDir = light.light_pos - intersectionPoint;
-            double lightDist = sqrt(lightDir.x * lightDir.x + lightDir.y * lightDir.y + lightDir.z * lightDir.z);
-            lightDir.x /= lightDist;
-            lightDir.y /= lightDist;
-            lightDir.z /= lightDist;
-
-            double cosTheta = -(lightDir.x * light.light_direction.x + lightDir.y * light.light_direction.y + lightDir.z * light.light_direction.z);
-            if (acos(cosTheta) * 180.0 / M_PI > light.cutoff_angle) continue;
+    // Bound of an ellipsoid with cross terms; infinite for anything open.
+    AABB generalBounds() const {
+        AABB box = AABB::infinite();
+
+        double m[3][3] = {{A, D / 2, E / 2}, {D / 2, B, F / 2}, {E / 2, F / 2, C}};
+        double sign = (A < 0) ? -1.0 : 1.0;
+        double minor1 = sign * m[0][0];
+        double minor2 = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+        double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                   - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                   + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+        if (minor1 > 0 && minor2 > 0 && sign * det > 0) {
+            double inv[3][3];
+            inv[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) / det;
+            inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) / det;
+            inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+            inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+            inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) / det;
+            inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+            inv[1][0] = inv[0][1];
+            inv[2][0] = inv[0][2];
+            inv[2][1] = inv[1][2];
+
+            double g[3] = {G, H, I};
+            double center[3];
+            for (int i = 0; i < 3; i++) {
+                center[i] = -0.5 * (inv[i][0] * g[0] + inv[i][1] * g[1] + inv[i][2] * g[2]);
+            }
 
-            Ray shadowRay(intersectionPoint + lightDir * 1e-6, lightDir);
-            bool inShadow = false;
-            for (const auto& obj : objects) {
-                if (obj->intersect(&shadowRay, color, 0) > 0 && obj->intersect(&shadowRay, color, 0) < lightDist) {
-                    inShadow = true;
-                    break;
+            double k = -J;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    k += center[i] * m[i][j] * center[j];
                 }
             }
 
-            if (inShadow) continue;
-
-            double lambert = std::max(0.0, normal.x * lightDir.x + normal.y * lightDir.y + normal.z * lightDir.z);
-            color[0] += coEfficients[1] * light.color[0] * lambert * this->color[0];
-            color[1] += coEfficients[1] * light.color[1] * lambert * this->color[1];
-            color[2] += coEfficients[1] * light.color[2] * lambert * this->color[2];
-
-            Vector3D reflectDir = lightDir - normal * (2.0 * (lightDir.x * normal.x + lightDir.y * normal.y + lightDir.z * normal.z));
-            double phong = std::max(0.0, -(ray->dir.x * reflectDir.x + ray->dir.y * reflectDir.y + ray->dir.z * reflectDir.z));
-            phong = pow(phong, shine);
-            color[0] += coEfficients[2] * light.color[0] * phong;
-            color[1] += coEfficients[2] * light.color[1] * phong;
-            color[2] += coEfficients[2] * light.color[2] * phong;
+            double extent[3];
+            for (int i = 0; i < 3; i++) {
+                extent[i] = sqrt(std::max(0.0, k * inv[i][i]));
+            }
+            box = AABB(Vector3D(center[0] - extent[0], center[1] - extent[1], center[2] - extent[2]),
+                       Vector3D(center[0] + extent[0], center[1] + extent[1], center[2] + extent[2]));
         }
+        return box;
+    }
 
-        if (level >= recursionLevel) return t;
-
-        Vector3D reflectDir = ray->dir - normal * (2.0 * (ray->dir.x * normal.x + ray->dir.y * normal.y + ray->dir.z * normal.z));
-        Ray reflectedRay(intersectionPoint + reflectDir * 1e-6, reflectDir);
-
-        double reflectedColor[3] = {0, 0, 0};
-        double tMin = 1e9;
-        Object* nearestObject = nullptr;
+    // Both ray parameters where the ray meets the surface, unordered and
+    // possibly non-finite; false when it misses outright.
+    bool solve(Ray* ray, double& t1, double& t2) const {
+        const Vector3<double>& d = ray->dir;
+        Vector3<double> o = shape == QUADRIC_GENERAL ? ray->start : ray->start - Vector3<double>(center);
+
+        if (shape == QUADRIC_SPHERE) {
+            // at^2 + 2bt + c = 0, with the discriminant from the closest
+            // approach as in Sphere::intersect.
+            double a = dot(d, d);
+            double b = dot(o, d);
+            double discriminant = a * (level / weight[0] - lengthSquared(o - d * (b / a)));
+            if (discriminant < 0) return false;
+            double root = sqrt(discriminant);
+            t1 = (-b - root) / a;
+            t2 = (-b + root) / a;
+            return true;
+        }
 
-        for (const auto& obj : objects) {
-            double t = obj->intersect(&reflectedRay, reflectedColor, level + 1);
-            if (t > 0 && t < tMin) {
-                tMin = t;
-                nearestObject = obj;
-            }
+        if (shape == QUADRIC_PLANE) {
+            double denom = G * d.x + H * d.y + I * d.z;
+            if (denom == 0) return false;
+            t1 = t2 = -(G * o.x + H * o.y + I * o.z + J) / denom;
+            return true;
         }
 
-        if (nearestObject) {
-            nearestObject->intersect(&reflectedRay, reflectedColor, level + 1);
-            color[0] += reflectedColor[0] * coEfficients[3];
-            color[1] += reflectedColor[1] * coEfficients[3];
-            color[2] += reflectedColor[2] * coEfficients[3];
+        double a, b, c;
+        if (shape == QUADRIC_GENERAL) {
+            double dx = d.x, dy = d.y, dz = d.z;
+            double ox = o.x, oy = o.y, oz = o.z;
+            a = A * dx * dx + B * dy * dy + C * dz * dz + D * dx * dy + E * dx * dz + F * dy * dz;
+            b = 0.5 * (2 * (A * ox * dx + B * oy * dy + C * oz * dz) + D * (ox * dy + oy * dx) + E * (ox * dz + oz * dx) + F * (oy * dz + oz * dy) + G * dx + H * dy + I * dz);
+            c = A * ox * ox + B * oy * oy + C * oz * oz + D * ox * oy + E * ox * oz + F * oy * oz + G * ox + H * oy + I * oz + J;
+        } else {
+            a = weight[0] * d.x * d.x + weight[1] * d.y * d.y + weight[2] * d.z * d.z;
+            b = weight[0] * o.x * d.x + weight[1] * o.y * d.y + weight[2] * o.z * d.z;
+            c = weight[0] * o.x * o.x + weight[1] * o.y * o.y + weight[2] * o.z * o.z - level;
         }
 
-        return t;
+        // at^2 + 2bt + c = 0 in the cancellation-free form; when a vanishes
+        // (the ray runs along a cylinder, cone or paraboloid axis) q / a
+        // goes non-finite and c / q is the single linear root.
+        double discriminant = b * b - a * c;
+        if (discriminant < 0) return false;
+        double q = -(b + copysign(sqrt(discriminant), b));
+        if (q == 0) return false;
+        t1 = q / a;
+        t2 = c / q;
+        return true;
+    }
+
+    double nearestRoot(Ray* ray) {
+        if (cullBox.intersect(*ray, ray->tMax) == std::numeric_limits<double>::infinity()) return -1.0;
+
+        double t1, t2;
+        if (!solve(ray, t1, t2)) return -1.0;
+        if (t2 < t1) std::swap(t1, t2);
+        if (isInsideBoundingBox(ray, t1)) return t1;
+        if (isInsideBoundingBox(ray, t2)) return t2;
+        return -1.0;
     }
 };
 
@@ -4,6 +4,17 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <GL/glut.h>
 
 using namespace std;
@@ -12,8 +23,30 @@ vector<Object*> objects;
 vector<PointLight> pointLights;
 vector<SpotLight> spotLights;
 Floor* globalFloor = nullptr;
+BVH sceneBVH;
+LightTree lightTree;
+bool scenePrebuilt = false;
 
 int recursionLevel;
+int maxPathDepth = 0;
+double minPathThroughput = 1e-4;
+double rouletteThroughput = 0.0;
+int imageResolution = 1920;
+int renderThreads = 0;
+bool packetTracing = false;
+bool watertightTriangles = false;
+int exactLightLimit = 64;
+int lightSamplesPerHit = 8;
+double lightRange = numeric_limits<double>::infinity();
+int maxPixelSamples = 1;
+bool streamOutput = false;
+ToneMapOperator toneMapOperator = TONEMAP_CLAMP;
+double exposure = 0.0;
+string pfmPath;
+double adaptiveThreshold = 0.1;
+string heatmapPath;
+bool heatmapNanoseconds = false;
+std::atomic<int> imageCount(11);
 
 Vector3D cameraPos(0, -500, 200);
 Vector3D cameraLookDir(0, 1, 0);
@@ -21,14 +54,368 @@ Vector3D cameraUp(0, 0, 1);
 Vector3D cameraRight(1, 0, 0);
 float cameraTilt = 0.0;
 
-void loadData() {
-    ifstream sceneFile("scene.txt");
-    if (!sceneFile.is_open()) {
-        cerr << "Error: Could not open scene.txt" << endl;
-        return;
+struct RenderOptions {
+    string scenePath = "scene.txt";
+    string outputPath;
+    int resolution = 0;
+    int threads = 0;
+    bool batch = false;
+    bool benchmark = false;
+    bool packets = false;
+    bool watertight = false;
+    int triangleBench = 0;
+    int maxDepth = 0;
+    double minThroughput = 1e-4;
+    double roulette = 0.0;
+    int lightExact = 64;
+    int lightSamples = 8;
+    double lightRange = numeric_limits<double>::infinity();
+    int samples = 1;
+    double threshold = 0.1;
+    bool texture = false;
+    bool stream = false;
+    ToneMapOperator toneMap = TONEMAP_CLAMP;
+    double exposure = 0.0;
+    string pfmPath;
+    string fromPfmPath;
+    string convertPath;
+    string comparePath;
+    string compareTestPath;
+    double tolerance = 2.0;
+    string heatmapPath;
+    bool heatmapNanoseconds = false;
+    bool hasCameraPos = false;
+    bool hasCameraDir = false;
+    Vector3D cameraPos;
+    Vector3D cameraDir;
+};
+
+Floor* createFloor() {
+    Floor* floor = new Floor(1000, 20, "");
+    floor->setColor(1.0, 1.0, 1.0);
+    floor->setCoEfficients(0.4, 0.2, 0.2, 0.2);
+    floor->setShine(1);
+    return floor;
+}
+
+// OBJ faces may be polygons; they are fan-triangulated. Indices are 1-based,
+// or negative to count back from the most recent vertex.
+static int objIndex(long value, int count) {
+    if (value > 0) return (int)value - 1;
+    if (value < 0) return count + (int)value;
+    return -1;
+}
+
+static void pushCorners(vector<int>& corners, size_t triangleCorners, int a, int b, int c) {
+    if (corners.size() < triangleCorners) corners.resize(triangleCorners, -1);
+    corners.push_back(a);
+    corners.push_back(b);
+    corners.push_back(c);
+}
+
+bool loadObj(const string& path, Mesh& mesh) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open " << path << endl;
+        return false;
+    }
+
+    string line;
+    vector<int> face, faceNormal;
+    int lineNumber = 0;
+    while (getline(file, line)) {
+        lineNumber++;
+        const char* c = line.c_str();
+        while (*c == ' ' || *c == '\t') c++;
+        char* end;
+
+        if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) {
+            Vector3D p;
+            p.x = strtod(c + 2, &end);
+            p.y = strtod(end, &end);
+            p.z = strtod(end, &end);
+            mesh.positions.push_back(p);
+        } else if (c[0] == 'v' && c[1] == 'n') {
+            Vector3D n;
+            n.x = strtod(c + 2, &end);
+            n.y = strtod(end, &end);
+            n.z = strtod(end, &end);
+            mesh.normals.push_back(n);
+        } else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) {
+            face.clear();
+            faceNormal.clear();
+            c++;
+            while (true) {
+                while (*c == ' ' || *c == '\t') c++;
+                if (*c == '\0' || *c == '\r' || *c == '#') break;
+                long value = strtol(c, &end, 10);
+                if (end == c) break;
+                face.push_back(objIndex(value, (int)mesh.positions.size()));
+                int normal = -1;
+                c = end;
+                if (*c == '/') {
+                    // Texture coordinates are skipped; nothing samples them.
+                    c++;
+                    while (*c && *c != '/' && *c != ' ' && *c != '\t') c++;
+                    if (*c == '/') {
+                        normal = objIndex(strtol(c + 1, &end, 10), (int)mesh.normals.size());
+                        c = end;
+                    }
+                }
+                faceNormal.push_back(normal);
+                while (*c && *c != ' ' && *c != '\t') c++;
+            }
+
+            for (int index : face) {
+                if (index < 0 || index >= (int)mesh.positions.size()) {
+                    cerr << "Error: " << path << ":" << lineNumber << " references a missing vertex" << endl;
+                    return false;
+                }
+            }
+
+            bool hasNormal = find(faceNormal.begin(), faceNormal.end(), -1) == faceNormal.end();
+            for (size_t k = 1; k + 1 < face.size(); k++) {
+                size_t corners = mesh.indices.size();
+                mesh.indices.push_back(face[0]);
+                mesh.indices.push_back(face[k]);
+                mesh.indices.push_back(face[k + 1]);
+                if (hasNormal || !mesh.normalIndices.empty()) {
+                    pushCorners(mesh.normalIndices, corners, hasNormal ? faceNormal[0] : -1,
+                                hasNormal ? faceNormal[k] : -1, hasNormal ? faceNormal[k + 1] : -1);
+                }
+            }
+        }
+    }
+
+    if (!mesh.normalIndices.empty()) mesh.normalIndices.resize(mesh.indices.size(), -1);
+    if (mesh.normalIndices.empty()) mesh.normals.clear();
+    return true;
+}
+
+enum PlyType {
+    PLY_NONE,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64
+};
+
+enum PlyFormat {
+    PLY_ASCII,
+    PLY_LITTLE_ENDIAN,
+    PLY_BIG_ENDIAN
+};
+
+// Vertex fields a mesh keeps; anything else is read and discarded.
+enum PlyField {
+    PLY_SKIP = -1,
+    PLY_X, PLY_Y, PLY_Z,
+    PLY_NX, PLY_NY, PLY_NZ,
+    PLY_FIELD_COUNT
+};
+
+struct PlyProperty {
+    PlyType type;
+    PlyType countType;
+    int field;
+    bool faceIndices;
+};
+
+struct PlyElement {
+    string name;
+    long long count;
+    vector<PlyProperty> properties;
+};
+
+static PlyType plyType(const string& name) {
+    if (name == "char" || name == "int8") return PLY_INT8;
+    if (name == "uchar" || name == "uint8") return PLY_UINT8;
+    if (name == "short" || name == "int16") return PLY_INT16;
+    if (name == "ushort" || name == "uint16") return PLY_UINT16;
+    if (name == "int" || name == "int32") return PLY_INT32;
+    if (name == "uint" || name == "uint32") return PLY_UINT32;
+    if (name == "float" || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_NONE;
+}
+
+static int plyField(const string& name) {
+    static const char* const names[PLY_FIELD_COUNT] = {"x", "y", "z", "nx", "ny", "nz"};
+    for (int field = 0; field < PLY_FIELD_COUNT; field++) {
+        if (name == names[field]) return field;
+    }
+    return PLY_SKIP;
+}
+
+static bool readPlyValue(istream& in, PlyType type, PlyFormat format, double& value) {
+    if (format == PLY_ASCII) return (bool)(in >> value);
+
+    static const int sizes[] = {0, 1, 1, 2, 2, 4, 4, 4, 8};
+    int size = sizes[type];
+    unsigned char bytes[8];
+    if (!in.read(reinterpret_cast<char*>(bytes), size)) return false;
+
+    uint16_t probe = 1;
+    bool hostLittle = *reinterpret_cast<unsigned char*>(&probe) == 1;
+    if (hostLittle != (format == PLY_LITTLE_ENDIAN)) std::reverse(bytes, bytes + size);
+
+    switch (type) {
+        case PLY_INT8: value = (int8_t)bytes[0]; break;
+        case PLY_UINT8: value = bytes[0]; break;
+        case PLY_INT16: { int16_t v; memcpy(&v, bytes, 2); value = v; break; }
+        case PLY_UINT16: { uint16_t v; memcpy(&v, bytes, 2); value = v; break; }
+        case PLY_INT32: { int32_t v; memcpy(&v, bytes, 4); value = v; break; }
+        case PLY_UINT32: { uint32_t v; memcpy(&v, bytes, 4); value = v; break; }
+        case PLY_FLOAT32: { float v; memcpy(&v, bytes, 4); value = v; break; }
+        default: { double v; memcpy(&v, bytes, 8); value = v; break; }
+    }
+    return true;
+}
+
+// Reads ascii and both binary PLY encodings one element at a time. Only the
+// vertex position/normal properties and the face index list are kept.
+bool loadPly(const string& path, Mesh& mesh) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open " << path << endl;
+        return false;
+    }
+
+    string line;
+    getline(file, line);
+    if (line.compare(0, 3, "ply") != 0) {
+        cerr << "Error: " << path << " is not a PLY file" << endl;
+        return false;
+    }
+
+    PlyFormat format = PLY_ASCII;
+    vector<PlyElement> elements;
+    bool headerValid = false;
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        istringstream words(line);
+        string keyword;
+        words >> keyword;
+        if (keyword == "format") {
+            string name;
+            words >> name;
+            if (name == "binary_little_endian") format = PLY_LITTLE_ENDIAN;
+            else if (name == "binary_big_endian") format = PLY_BIG_ENDIAN;
+        } else if (keyword == "element") {
+            PlyElement element;
+            words >> element.name >> element.count;
+            elements.push_back(element);
+        } else if (keyword == "property" && !elements.empty()) {
+            string type, countType, name;
+            words >> type;
+            if (type == "list") words >> countType >> type;
+            words >> name;
+
+            PlyProperty property;
+            property.type = plyType(type);
+            property.countType = countType.empty() ? PLY_NONE : plyType(countType);
+            bool isVertex = elements.back().name == "vertex";
+            property.field = isVertex && countType.empty() ? plyField(name) : PLY_SKIP;
+            property.faceIndices = elements.back().name == "face" && (name == "vertex_indices" || name == "vertex_index");
+            if (property.type == PLY_NONE || (!countType.empty() && property.countType == PLY_NONE)) break;
+            elements.back().properties.push_back(property);
+        } else if (keyword == "end_header") {
+            headerValid = true;
+            break;
+        }
+    }
+    if (!headerValid) {
+        cerr << "Error: " << path << " has an unsupported PLY header" << endl;
+        return false;
+    }
+
+    vector<int> face;
+    for (const PlyElement& element : elements) {
+        bool isVertex = element.name == "vertex";
+        bool hasNormal = false;
+        for (const PlyProperty& property : element.properties) hasNormal = hasNormal || property.field == PLY_NX;
+
+        for (long long n = 0; n < element.count && file; n++) {
+            double fields[PLY_FIELD_COUNT] = {0};
+            for (const PlyProperty& property : element.properties) {
+                double value;
+                if (property.countType == PLY_NONE) {
+                    if (!readPlyValue(file, property.type, format, value)) break;
+                    if (property.field != PLY_SKIP) fields[property.field] = value;
+                    continue;
+                }
+
+                double count;
+                if (!readPlyValue(file, property.countType, format, count)) break;
+                face.clear();
+                for (int k = 0; k < (int)count && readPlyValue(file, property.type, format, value); k++) {
+                    face.push_back((int)value);
+                }
+                if (!property.faceIndices) continue;
+                for (size_t k = 1; k + 1 < face.size(); k++) {
+                    mesh.indices.push_back(face[0]);
+                    mesh.indices.push_back(face[k]);
+                    mesh.indices.push_back(face[k + 1]);
+                }
+            }
+            if (!isVertex) continue;
+
+            mesh.positions.push_back(Vector3D(fields[PLY_X], fields[PLY_Y], fields[PLY_Z]));
+            if (hasNormal) mesh.normals.push_back(Vector3D(fields[PLY_NX], fields[PLY_NY], fields[PLY_NZ]));
+        }
+        if (!file) {
+            cerr << "Error: " << path << " is truncated" << endl;
+            return false;
+        }
     }
 
-    int imageResolution;
+    for (int index : mesh.indices) {
+        if (index < 0 || index >= (int)mesh.positions.size()) {
+            cerr << "Error: " << path << " references a missing vertex" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loads an .obj or .ply file, then scales and translates it into place.
+Mesh* loadMesh(const string& path, const Vector3D& translation, double scale) {
+    Mesh* mesh = new Mesh();
+    string extension = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+    for (char& ch : extension) ch = tolower(ch);
+
+    bool loaded = false;
+    if (extension == ".obj") {
+        loaded = loadObj(path, *mesh);
+    } else if (extension == ".ply") {
+        loaded = loadPly(path, *mesh);
+    } else {
+        cerr << "Error: " << path << " is not an .obj or .ply mesh" << endl;
+    }
+    if (!loaded || mesh->triangleCount() == 0) {
+        if (loaded) cerr << "Error: " << path << " has no faces" << endl;
+        delete mesh;
+        return nullptr;
+    }
+
+    for (Vector3D& p : mesh->positions) {
+        p = p * scale + translation;
+    }
+    if (scale < 0) {
+        for (Vector3D& n : mesh->normals) n = n * -1.0;
+    }
+    mesh->build();
+    return mesh;
+}
+
+// Relative mesh paths are taken from sceneDir, the scene file's directory
+// with its trailing slash, so a scene loads the same from any working
+// directory.
+bool loadScene(istream& sceneFile, const string& sceneDir = "") {
     sceneFile >> recursionLevel >> imageResolution;
 
     int numObjects;
@@ -91,6 +478,26 @@ void loadData() {
             general->setCoEfficients(coEfficients[0], coEfficients[1], coEfficients[2], coEfficients[3]);
             general->setShine(shine);
             objects.push_back(general);
+        } else if (objectType == "mesh") {
+            string path;
+            Vector3D translation;
+            double scale;
+            double color[3], coEfficients[4];
+            int shine;
+
+            sceneFile >> path;
+            sceneFile >> translation.x >> translation.y >> translation.z >> scale;
+            sceneFile >> color[0] >> color[1] >> color[2];
+            sceneFile >> coEfficients[0] >> coEfficients[1] >> coEfficients[2] >> coEfficients[3];
+            sceneFile >> shine;
+
+            if (!path.empty() && path[0] != '/') path = sceneDir + path;
+            Mesh* mesh = loadMesh(path, translation, scale);
+            if (!mesh) return false;
+            mesh->setColor(color[0], color[1], color[2]);
+            mesh->setCoEfficients(coEfficients[0], coEfficients[1], coEfficients[2], coEfficients[3]);
+            mesh->setShine(shine);
+            objects.push_back(mesh);
         }
     }
 
@@ -123,84 +530,1417 @@ void loadData() {
         SpotLight spotLight(position, color[0], color[1], color[2], direction, cutoffAngle);
         spotLights.push_back(spotLight);
     }
+    lightTree.build();
 
-    sceneFile.close();
-    
-    Floor* floor = new Floor(1000, 20, "");
-    floor->setColor(1.0, 1.0, 1.0);
-    floor->setCoEfficients(0.4, 0.2, 0.2, 0.2);
-    floor->setShine(1);
+    Floor* floor = createFloor();
     objects.push_back(floor);
     globalFloor = floor;
+    return true;
 }
 
-void capture() {
-    const int imageWidth = 1920;
-    const int imageHeight = 1920;
-    bitmap_image image(imageWidth, imageHeight);
-    image.clear();
+// Binary scenes are a header followed by 8-byte aligned arrays of the records
+// below, in this order: object kinds, spheres, triangles, generals, point
+// lights, spot lights, BVH nodes, BVH primitive order, unbounded objects.
+// Objects are referenced by their index in the scene's original order.
+static const char BINARY_SCENE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '1'};
 
-    Vector3D eye = cameraPos;
-    Vector3D target = cameraPos + cameraLookDir;
-    
-    Vector3D l = cameraLookDir;
-    Vector3D r = cameraRight;   
-    Vector3D u = cameraUp;
-
-    double fov = 70.0 * M_PI / 180.0;
-    double aspect = 1.0;
-    double nearPlane = 1.0;
-    
-    double halfHeight = nearPlane * tan(fov / 2.0);
-    double halfWidth = halfHeight * aspect;
-    
-    Vector3D center = eye + l * nearPlane;
-    Vector3D topLeft = center + u * halfHeight - r * halfWidth;
-    
-    double pixelWidth = (2.0 * halfWidth) / imageWidth;
-    double pixelHeight = (2.0 * halfHeight) / imageHeight;
-
-    for (int i = 0; i < imageWidth; i++) {
-        for (int j = 0; j < imageHeight; j++) {
-            Vector3D pixelPos = topLeft + r * (i * pixelWidth) - u * (j * pixelHeight);
-            
-            Vector3D rayDir = pixelPos - eye;
-            Ray ray(eye, rayDir);
-
-            double tMin = 1e9;
-            Object* nearestObject = nullptr;
-            double pixelColor[3] = {0, 0, 0};
-
-            for (Object* obj : objects) {
-                double t = obj->intersect(&ray, pixelColor, 0);
-                if (t > 0 && t < tMin) {
-                    tMin = t;
-                    nearestObject = obj;
+struct BinarySceneHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int32_t recursionLevel;
+    int32_t imageResolution;
+    uint32_t objectCount, sphereCount, triangleCount, generalCount;
+    uint32_t pointLightCount, spotLightCount;
+    uint32_t nodeCount, primitiveCount, unboundedCount, reserved;
+};
+
+struct SphereRecord {
+    double center[3], radius;
+    double color[3], coEfficients[4];
+    int32_t shine, reserved;
+};
+
+struct TriangleRecord {
+    double points[9];
+    double color[3], coEfficients[4];
+    int32_t shine, reserved;
+};
+
+struct GeneralRecord {
+    double quadric[10], reference[3], size[3];
+    double color[3], coEfficients[4];
+    int32_t shine, reserved;
+};
+
+struct PointLightRecord {
+    double position[3], color[3];
+};
+
+struct SpotLightRecord {
+    double position[3], color[3], direction[3], cutoff;
+};
+
+// BVH nodes are stored as laid out in memory, so float and double builds
+// write different versions and refuse each other's files.
+static const uint32_t BINARY_SCENE_VERSION = sizeof(Real) == sizeof(double) ? 1 : 2;
+static_assert(sizeof(BVHNode) == 6 * sizeof(Real) + 16, "BVHNode layout is part of the binary scene format");
+
+struct SceneArena {
+    vector<Sphere> spheres;
+    vector<Triangle> triangles;
+    vector<General> generals;
+
+    bool owns(const Object* obj) const {
+        return contains(spheres, obj) || contains(triangles, obj) || contains(generals, obj);
+    }
+
+    void clear() {
+        spheres.clear();
+        triangles.clear();
+        generals.clear();
+    }
+
+private:
+    template <typename T>
+    static bool contains(const vector<T>& pool, const Object* obj) {
+        return !pool.empty() && obj >= &pool.front() && obj <= &pool.back();
+    }
+};
+
+SceneArena sceneArena;
+
+static size_t alignedSize(size_t bytes) {
+    return (bytes + 7) & ~(size_t)7;
+}
+
+template <typename T>
+static void writeSection(ofstream& out, const vector<T>& records) {
+    size_t bytes = records.size() * sizeof(T);
+    if (bytes) out.write(reinterpret_cast<const char*>(records.data()), bytes);
+    static const char padding[8] = {0};
+    out.write(padding, alignedSize(bytes) - bytes);
+}
+
+bool saveBinaryScene(const string& path) {
+    unordered_map<const Object*, uint32_t> objectIndex;
+    vector<uint8_t> kinds;
+    vector<SphereRecord> spheres;
+    vector<TriangleRecord> triangles;
+    vector<GeneralRecord> generals;
+
+    for (Object* obj : objects) {
+        objectIndex[obj] = (uint32_t)kinds.size();
+        int kind = obj->getPrimitiveKind();
+        kinds.push_back((uint8_t)kind);
+
+        if (kind == PRIM_SPHERE) {
+            SphereRecord record = {};
+            record.center[0] = obj->reference_point.x;
+            record.center[1] = obj->reference_point.y;
+            record.center[2] = obj->reference_point.z;
+            record.radius = obj->length;
+            memcpy(record.color, obj->color, sizeof(record.color));
+            memcpy(record.coEfficients, obj->coEfficients, sizeof(record.coEfficients));
+            record.shine = obj->shine;
+            spheres.push_back(record);
+        } else if (kind == PRIM_TRIANGLE) {
+            Triangle* triangle = static_cast<Triangle*>(obj);
+            TriangleRecord record = {};
+            for (int k = 0; k < 3; k++) {
+                record.points[3 * k] = triangle->points[k].x;
+                record.points[3 * k + 1] = triangle->points[k].y;
+                record.points[3 * k + 2] = triangle->points[k].z;
+            }
+            memcpy(record.color, obj->color, sizeof(record.color));
+            memcpy(record.coEfficients, obj->coEfficients, sizeof(record.coEfficients));
+            record.shine = obj->shine;
+            triangles.push_back(record);
+        } else if (kind == PRIM_GENERAL) {
+            General* general = static_cast<General*>(obj);
+            GeneralRecord record = {};
+            double quadric[10] = {general->A, general->B, general->C, general->D, general->E,
+                                  general->F, general->G, general->H, general->I, general->J};
+            memcpy(record.quadric, quadric, sizeof(quadric));
+            record.reference[0] = general->cubeReferencePoint.x;
+            record.reference[1] = general->cubeReferencePoint.y;
+            record.reference[2] = general->cubeReferencePoint.z;
+            record.size[0] = general->length;
+            record.size[1] = general->width;
+            record.size[2] = general->height;
+            memcpy(record.color, obj->color, sizeof(record.color));
+            memcpy(record.coEfficients, obj->coEfficients, sizeof(record.coEfficients));
+            record.shine = obj->shine;
+            generals.push_back(record);
+        } else if (kind != PRIM_FLOOR) {
+            cerr << "Error: " << primitiveKindNames[kind] << " objects cannot be stored in a binary scene" << endl;
+            return false;
+        }
+    }
+
+    vector<PointLightRecord> points;
+    for (const auto& light : pointLights) {
+        points.push_back({{light.light_pos.x, light.light_pos.y, light.light_pos.z},
+                          {light.color[0], light.color[1], light.color[2]}});
+    }
+    vector<SpotLightRecord> spots;
+    for (const auto& light : spotLights) {
+        spots.push_back({{light.light_pos.x, light.light_pos.y, light.light_pos.z},
+                         {light.color[0], light.color[1], light.color[2]},
+                         {light.light_direction.x, light.light_direction.y, light.light_direction.z},
+                         light.cutoff_angle});
+    }
+
+    vector<uint32_t> primitiveOrder, unboundedOrder;
+    for (Object* obj : sceneBVH.primitives) primitiveOrder.push_back(objectIndex[obj]);
+    for (Object* obj : sceneBVH.unbounded) unboundedOrder.push_back(objectIndex[obj]);
+
+    BinarySceneHeader header = {};
+    memcpy(header.magic, BINARY_SCENE_MAGIC, sizeof(header.magic));
+    header.version = BINARY_SCENE_VERSION;
+    header.byteOrder = 0x01020304;
+    header.recursionLevel = recursionLevel;
+    header.imageResolution = imageResolution;
+    header.objectCount = (uint32_t)kinds.size();
+    header.sphereCount = (uint32_t)spheres.size();
+    header.triangleCount = (uint32_t)triangles.size();
+    header.generalCount = (uint32_t)generals.size();
+    header.pointLightCount = (uint32_t)points.size();
+    header.spotLightCount = (uint32_t)spots.size();
+    header.nodeCount = (uint32_t)sceneBVH.nodes.size();
+    header.primitiveCount = (uint32_t)primitiveOrder.size();
+    header.unboundedCount = (uint32_t)unboundedOrder.size();
+
+    ofstream out(path, ios::binary);
+    if (!out.is_open()) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeSection(out, kinds);
+    writeSection(out, spheres);
+    writeSection(out, triangles);
+    writeSection(out, generals);
+    writeSection(out, points);
+    writeSection(out, spots);
+    writeSection(out, sceneBVH.nodes);
+    writeSection(out, primitiveOrder);
+    writeSection(out, unboundedOrder);
+    return out.good();
+}
+
+bool isBinaryScene(const string& path) {
+    ifstream file(path, ios::binary);
+    char magic[sizeof(BINARY_SCENE_MAGIC)];
+    return file.read(magic, sizeof(magic)) && memcmp(magic, BINARY_SCENE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool loadBinaryScene(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: Could not open " << path << endl;
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(BinarySceneHeader)) {
+        close(fd);
+        cerr << "Error: " << path << " is not a binary scene" << endl;
+        return false;
+    }
+    size_t fileSize = (size_t)info.st_size;
+    void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        cerr << "Error: Could not map " << path << endl;
+        return false;
+    }
+
+    const char* base = static_cast<const char*>(mapping);
+    BinarySceneHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    size_t offsets[10];
+    size_t sizes[9] = {
+        header.objectCount * sizeof(uint8_t),
+        header.sphereCount * sizeof(SphereRecord),
+        header.triangleCount * sizeof(TriangleRecord),
+        header.generalCount * sizeof(GeneralRecord),
+        header.pointLightCount * sizeof(PointLightRecord),
+        header.spotLightCount * sizeof(SpotLightRecord),
+        header.nodeCount * sizeof(BVHNode),
+        header.primitiveCount * sizeof(uint32_t),
+        header.unboundedCount * sizeof(uint32_t),
+    };
+    offsets[0] = sizeof(header);
+    for (int section = 0; section < 9; section++) {
+        offsets[section + 1] = offsets[section] + alignedSize(sizes[section]);
+    }
+
+    bool valid = memcmp(header.magic, BINARY_SCENE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == BINARY_SCENE_VERSION && header.byteOrder == 0x01020304 && offsets[9] <= fileSize;
+    const uint8_t* kinds = reinterpret_cast<const uint8_t*>(base + offsets[0]);
+    const uint32_t* primitiveOrder = reinterpret_cast<const uint32_t*>(base + offsets[7]);
+    const uint32_t* unboundedOrder = reinterpret_cast<const uint32_t*>(base + offsets[8]);
+    if (valid) {
+        uint32_t counts[PRIM_KIND_COUNT] = {0};
+        for (uint32_t i = 0; i < header.objectCount; i++) {
+            valid = valid && kinds[i] < PRIM_KIND_COUNT;
+            if (valid) counts[kinds[i]]++;
+        }
+        valid = valid && counts[PRIM_SPHERE] == header.sphereCount && counts[PRIM_TRIANGLE] == header.triangleCount &&
+                counts[PRIM_GENERAL] == header.generalCount && counts[PRIM_MESH] == 0 && counts[PRIM_OTHER] == 0;
+        for (uint32_t i = 0; valid && i < header.primitiveCount; i++) valid = primitiveOrder[i] < header.objectCount;
+        for (uint32_t i = 0; valid && i < header.unboundedCount; i++) valid = unboundedOrder[i] < header.objectCount;
+        valid = valid && header.nodeCount <= INT_MAX && header.primitiveCount <= INT_MAX &&
+                BVH::validNodes(reinterpret_cast<const BVHNode*>(base + offsets[6]), (int)header.nodeCount, (int)header.primitiveCount);
+        // Leaves list their spheres, then their triangles, then everything
+        // else; the packed kernels trust those counts.
+        const BVHNode* nodeRecords = reinterpret_cast<const BVHNode*>(base + offsets[6]);
+        for (uint32_t n = 0; valid && n < header.nodeCount; n++) {
+            const BVHNode& node = nodeRecords[n];
+            for (int k = 0; valid && k < node.count; k++) {
+                uint8_t kind = kinds[primitiveOrder[node.leftFirst + k]];
+                if (k < node.sphereCount) valid = kind == PRIM_SPHERE;
+                else if (k < node.sphereCount + node.triangleCount) valid = kind == PRIM_TRIANGLE;
+                else valid = kind != PRIM_SPHERE && kind != PRIM_TRIANGLE;
+            }
+        }
+    }
+    if (!valid) {
+        munmap(mapping, fileSize);
+        cerr << "Error: " << path << " is not a valid binary scene" << endl;
+        return false;
+    }
+
+    recursionLevel = header.recursionLevel;
+    imageResolution = header.imageResolution;
+
+    const SphereRecord* sphereRecords = reinterpret_cast<const SphereRecord*>(base + offsets[1]);
+    const TriangleRecord* triangleRecords = reinterpret_cast<const TriangleRecord*>(base + offsets[2]);
+    const GeneralRecord* generalRecords = reinterpret_cast<const GeneralRecord*>(base + offsets[3]);
+    sceneArena.spheres.reserve(header.sphereCount);
+    sceneArena.triangles.reserve(header.triangleCount);
+    sceneArena.generals.reserve(header.generalCount);
+
+    objects.reserve(objects.size() + header.objectCount);
+    for (uint32_t i = 0; i < header.objectCount; i++) {
+        Object* obj;
+        const double* color;
+        const double* coEfficients;
+        int shine;
+        if (kinds[i] == PRIM_SPHERE) {
+            const SphereRecord& record = sphereRecords[sceneArena.spheres.size()];
+            sceneArena.spheres.emplace_back(Vector3D(record.center[0], record.center[1], record.center[2]), record.radius);
+            obj = &sceneArena.spheres.back();
+            color = record.color;
+            coEfficients = record.coEfficients;
+            shine = record.shine;
+        } else if (kinds[i] == PRIM_TRIANGLE) {
+            const TriangleRecord& record = triangleRecords[sceneArena.triangles.size()];
+            const double* p = record.points;
+            sceneArena.triangles.emplace_back(Vector3D(p[0], p[1], p[2]), Vector3D(p[3], p[4], p[5]), Vector3D(p[6], p[7], p[8]));
+            obj = &sceneArena.triangles.back();
+            color = record.color;
+            coEfficients = record.coEfficients;
+            shine = record.shine;
+        } else if (kinds[i] == PRIM_GENERAL) {
+            const GeneralRecord& record = generalRecords[sceneArena.generals.size()];
+            const double* q = record.quadric;
+            sceneArena.generals.emplace_back(q[0], q[1], q[2], q[3], q[4], q[5], q[6], q[7], q[8], q[9],
+                                             Vector3D(record.reference[0], record.reference[1], record.reference[2]),
+                                             record.size[0], record.size[1], record.size[2]);
+            obj = &sceneArena.generals.back();
+            color = record.color;
+            coEfficients = record.coEfficients;
+            shine = record.shine;
+        } else {
+            globalFloor = createFloor();
+            objects.push_back(globalFloor);
+            continue;
+        }
+        obj->setColor(color[0], color[1], color[2]);
+        obj->setCoEfficients(coEfficients[0], coEfficients[1], coEfficients[2], coEfficients[3]);
+        obj->setShine(shine);
+        objects.push_back(obj);
+    }
+
+    const PointLightRecord* pointRecords = reinterpret_cast<const PointLightRecord*>(base + offsets[4]);
+    for (uint32_t i = 0; i < header.pointLightCount; i++) {
+        const PointLightRecord& record = pointRecords[i];
+        pointLights.push_back(PointLight(Vector3D(record.position[0], record.position[1], record.position[2]),
+                                         record.color[0], record.color[1], record.color[2]));
+    }
+    const SpotLightRecord* spotRecords = reinterpret_cast<const SpotLightRecord*>(base + offsets[5]);
+    for (uint32_t i = 0; i < header.spotLightCount; i++) {
+        const SpotLightRecord& record = spotRecords[i];
+        spotLights.push_back(SpotLight(Vector3D(record.position[0], record.position[1], record.position[2]),
+                                       record.color[0], record.color[1], record.color[2],
+                                       Vector3D(record.direction[0], record.direction[1], record.direction[2]), record.cutoff));
+    }
+    lightTree.build();
+
+    const BVHNode* nodeRecords = reinterpret_cast<const BVHNode*>(base + offsets[6]);
+    vector<BVHNode> nodes(nodeRecords, nodeRecords + header.nodeCount);
+    vector<Object*> primitives(header.primitiveCount), unbounded(header.unboundedCount);
+    for (uint32_t i = 0; i < header.primitiveCount; i++) primitives[i] = objects[primitiveOrder[i]];
+    for (uint32_t i = 0; i < header.unboundedCount; i++) unbounded[i] = objects[unboundedOrder[i]];
+    munmap(mapping, fileSize);
+
+    sceneBVH.adopt(std::move(nodes), std::move(primitives), std::move(unbounded));
+    scenePrebuilt = true;
+    return true;
+}
+
+bool loadData(const string& scenePath = "scene.txt") {
+    if (isBinaryScene(scenePath)) {
+        return loadBinaryScene(scenePath);
+    }
+
+    ifstream sceneFile(scenePath);
+    if (!sceneFile.is_open()) {
+        cerr << "Error: Could not open " << scenePath << endl;
+        return false;
+    }
+    size_t slash = scenePath.find_last_of('/');
+    return loadScene(sceneFile, slash == string::npos ? "" : scenePath.substr(0, slash + 1));
+}
+
+void clearScene() {
+    for (Object* obj : objects) {
+        if (!sceneArena.owns(obj)) delete obj;
+    }
+    objects.clear();
+    sceneArena.clear();
+    pointLights.clear();
+    spotLights.clear();
+    lightTree.clear();
+    globalFloor = nullptr;
+    scenePrebuilt = false;
+    sceneBVH.build(objects);
+}
+
+double radicalInverse(int index, int base) {
+    double result = 0, scale = 1.0 / base;
+    for (; index > 0; index /= base, scale /= base) {
+        result += (index % base) * scale;
+    }
+    return result;
+}
+
+struct PinholeCamera {
+    Vector3<double> eye, r, u, topLeft;
+    double nearPlane, pixelWidth, pixelHeight;
+
+    PinholeCamera(int imageWidth = 1, int imageHeight = 1) {
+        eye = Vector3<double>(cameraPos.x, cameraPos.y, cameraPos.z);
+
+        Vector3<double> l(cameraLookDir.x, cameraLookDir.y, cameraLookDir.z);
+        r = Vector3<double>(cameraRight.x, cameraRight.y, cameraRight.z);
+        u = Vector3<double>(cameraUp.x, cameraUp.y, cameraUp.z);
+
+        double fov = 70.0 * M_PI / 180.0;
+        double aspect = 1.0;
+        nearPlane = 1.0;
+
+        double halfHeight = nearPlane * tan(fov / 2.0);
+        double halfWidth = halfHeight * aspect;
+
+        Vector3<double> center = eye + l * nearPlane;
+        topLeft = center + u * halfHeight - r * halfWidth;
+
+        pixelWidth = (2.0 * halfWidth) / imageWidth;
+        pixelHeight = (2.0 * halfHeight) / imageHeight;
+    }
+
+    Ray primaryRay(double i, double j) const {
+        Vector3<double> pixelPos = topLeft + r * (i * pixelWidth) - u * (j * pixelHeight);
+
+        Vector3<double> rayDir = pixelPos - eye;
+        Ray ray(eye, rayDir);
+        ray.coneSpread = pixelWidth / nearPlane;
+        return ray;
+    }
+};
+
+// Shared by every renderImage call so streamed bands and benchmark repeats
+// reuse the same worker threads; rebuilt only when --threads changes it.
+// Callers hold renderPoolLock for as long as they use the returned pool: a
+// rebuild would join its workers under a run in flight, and run() serves one
+// job at a time.
+std::mutex renderPoolLock;
+
+WorkStealingPool& renderPool() {
+    static unique_ptr<WorkStealingPool> pool;
+    if (!pool || pool->threadCount != WorkStealingPool::resolveThreads(renderThreads)) {
+        pool.reset(new WorkStealingPool(renderThreads));
+    }
+    return *pool;
+}
+
+RenderStats renderImage(HdrImage& image, bool timed = false, vector<double>* pixelCost = nullptr,
+                        int rowOffset = 0, int frameHeight = 0) {
+    const int imageWidth = image.width;
+    const int imageHeight = image.height;
+
+    PinholeCamera camera(imageWidth, frameHeight > 0 ? frameHeight : imageHeight);
+
+    const int tileSize = 32;
+    int tilesX = (imageWidth + tileSize - 1) / tileSize;
+    int tilesY = (imageHeight + tileSize - 1) / tileSize;
+
+    auto primaryRay = [&](double i, double j) {
+        return camera.primaryRay(i, j + rowOffset);
+    };
+
+    auto writePixel = [&](int i, int j, const double* pixelColor) {
+        float* stored = image.at(i, j);
+        stored[0] = (float)pixelColor[0];
+        stored[1] = (float)pixelColor[1];
+        stored[2] = (float)pixelColor[2];
+    };
+
+    bool adaptive = maxPixelSamples > 1;
+
+    auto costCounter = [&](const Integrator& integrator) -> double {
+        if (heatmapNanoseconds) {
+            return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        return (double)integrator.stats.totalTests();
+    };
+
+    if (pixelCost) pixelCost->assign((size_t)imageWidth * imageHeight, 0.0);
+
+    std::lock_guard<std::mutex> poolGuard(renderPoolLock);
+    WorkStealingPool& pool = renderPool();
+    std::vector<Integrator> integrators(pool.threadCount, Integrator(timed));
+    pool.run(tilesX * tilesY, [&](int tile, int worker) {
+        Integrator& integrator = integrators[worker];
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        int x1 = std::min(imageWidth, x0 + tileSize);
+        int y1 = std::min(imageHeight, y0 + tileSize);
+
+        if (!packetTracing) {
+            for (int i = x0; i < x1; i++) {
+                for (int j = y0; j < y1; j++) {
+                    double costBefore = pixelCost ? costCounter(integrator) : 0;
+                    Ray ray = primaryRay(i, j);
+                    double pixelColor[3] = {0, 0, 0};
+                    integrator.beginSample(i, j + rowOffset, 0);
+                    integrator.trace(&ray, pixelColor, 1);
+                    integrator.stats.pixelSamples++;
+                    writePixel(i, j, pixelColor);
+                    if (pixelCost) (*pixelCost)[(size_t)j * imageWidth + i] = costCounter(integrator) - costBefore;
                 }
             }
+            return;
+        }
+
+        std::vector<Ray> rays;
+        rays.reserve(RayPacket::size);
+        for (int bj = y0; bj < y1; bj += RayPacket::side) {
+            for (int bi = x0; bi < x1; bi += RayPacket::side) {
+                rays.clear();
+                RayPacket packet;
+                int activeLanes = 0;
+                for (int dj = 0; dj < RayPacket::side; dj++) {
+                    for (int di = 0; di < RayPacket::side; di++) {
+                        rays.push_back(primaryRay(bi + di, bj + dj));
+                        bool inside = bi + di < x1 && bj + dj < y1;
+                        packet.set(dj * RayPacket::side + di, rays.back(), inside);
+                        if (inside) activeLanes++;
+                    }
+                }
 
-            if (nearestObject) {
-                nearestObject->intersect(&ray, pixelColor, 1);
-                
-                pixelColor[0] = std::max(0.0, std::min(1.0, pixelColor[0]));
-                pixelColor[1] = std::max(0.0, std::min(1.0, pixelColor[1]));
-                pixelColor[2] = std::max(0.0, std::min(1.0, pixelColor[2]));
-                
-                image.set_pixel(i, j, 
-                    (unsigned char)(pixelColor[0] * 255), 
-                    (unsigned char)(pixelColor[1] * 255), 
-                    (unsigned char)(pixelColor[2] * 255));
-            } else {
-                image.set_pixel(i, j, 0, 0, 0);
+                double costBefore = pixelCost ? costCounter(integrator) : 0;
+                Object* hitObjects[RayPacket::size];
+                {
+                    ScopedTimer timer(timed ? &integrator.stats.primaryTime : nullptr);
+                    sceneBVH.intersectPacket(rays.data(), packet, hitObjects, integrator.stats.packets, &integrator.stats);
+                }
+                double traversalShare = pixelCost ? (costCounter(integrator) - costBefore) / activeLanes : 0;
+
+                for (int lane = 0; lane < RayPacket::size; lane++) {
+                    if (!packet.active[lane]) continue;
+                    double laneBefore = pixelCost ? costCounter(integrator) : 0;
+                    integrator.stats.primaryRays++;
+                    integrator.stats.pixelSamples++;
+                    double pixelColor[3] = {0, 0, 0};
+                    int i = bi + lane % RayPacket::side, j = bj + lane / RayPacket::side;
+                    if (hitObjects[lane]) {
+                        HitRecord hit;
+                        BVH::fillHit(&rays[lane], hitObjects[lane], packet.tNearest[lane], hit, packet.hitPart[lane]);
+                        integrator.beginSample(i, j + rowOffset, 0);
+                        integrator.shade(&rays[lane], hit, pixelColor, 1);
+                    }
+                    writePixel(i, j, pixelColor);
+                    if (pixelCost) (*pixelCost)[(size_t)j * imageWidth + i] = traversalShare + costCounter(integrator) - laneBefore;
+                }
             }
         }
+    });
+
+    if (adaptive) {
+        vector<unsigned char> refine((size_t)imageWidth * imageHeight, 0);
+        pool.run(tilesX * tilesY, [&](int tile, int worker) {
+            int x0 = (tile % tilesX) * tileSize;
+            int y0 = (tile / tilesX) * tileSize;
+            int x1 = std::min(imageWidth, x0 + tileSize);
+            int y1 = std::min(imageHeight, y0 + tileSize);
+
+            for (int i = x0; i < x1; i++) {
+                for (int j = y0; j < y1; j++) {
+                    double contrast = 0;
+                    for (int c = 0; c < 3; c++) {
+                        double lo = 1.0, hi = 0.0;
+                        for (int nj = std::max(0, j - 1); nj <= std::min(imageHeight - 1, j + 1); nj++) {
+                            for (int ni = std::max(0, i - 1); ni <= std::min(imageWidth - 1, i + 1); ni++) {
+                                double value = std::max(0.0f, std::min(1.0f, image.at(ni, nj)[c]));
+                                lo = std::min(lo, value);
+                                hi = std::max(hi, value);
+                            }
+                        }
+                        contrast = std::max(contrast, hi - lo);
+                    }
+                    refine[(size_t)j * imageWidth + i] = contrast >= adaptiveThreshold;
+                }
+            }
+        });
+
+        pool.run(tilesX * tilesY, [&](int tile, int worker) {
+            Integrator& integrator = integrators[worker];
+            int x0 = (tile % tilesX) * tileSize;
+            int y0 = (tile / tilesX) * tileSize;
+            int x1 = std::min(imageWidth, x0 + tileSize);
+            int y1 = std::min(imageHeight, y0 + tileSize);
+
+            auto displayLuminance = [](const double* color) {
+                double clamped[3];
+                for (int c = 0; c < 3; c++) clamped[c] = std::max(0.0, std::min(1.0, color[c]));
+                return 0.2126 * clamped[0] + 0.7152 * clamped[1] + 0.0722 * clamped[2];
+            };
+
+            for (int i = x0; i < x1; i++) {
+                for (int j = y0; j < y1; j++) {
+                    if (!refine[(size_t)j * imageWidth + i]) continue;
+
+                    double costBefore = pixelCost ? costCounter(integrator) : 0;
+                    const float* first = image.at(i, j);
+                    double sum[3] = {first[0], first[1], first[2]};
+                    double luminance = displayLuminance(sum);
+                    double luminanceSum = luminance, luminanceSquares = luminance * luminance;
+
+                    int samples = 1;
+                    while (samples < maxPixelSamples) {
+                        Ray ray = primaryRay(i + radicalInverse(samples, 2), j + radicalInverse(samples, 3));
+                        double sampleColor[3] = {0, 0, 0};
+                        integrator.beginSample(i, j + rowOffset, samples);
+                        integrator.trace(&ray, sampleColor, 1);
+                        for (int c = 0; c < 3; c++) sum[c] += sampleColor[c];
+                        luminance = displayLuminance(sampleColor);
+                        luminanceSum += luminance;
+                        luminanceSquares += luminance * luminance;
+                        samples++;
+
+                        if (samples % 4 != 0) continue;
+                        double mean = luminanceSum / samples;
+                        double variance = std::max(0.0, luminanceSquares / samples - mean * mean);
+                        if (sqrt(variance / samples) < 0.25 * adaptiveThreshold) break;
+                    }
+
+                    integrator.stats.pixelSamples += samples - 1;
+                    integrator.stats.refinedPixels++;
+                    double pixelColor[3] = {sum[0] / samples, sum[1] / samples, sum[2] / samples};
+                    writePixel(i, j, pixelColor);
+                    if (pixelCost) (*pixelCost)[(size_t)j * imageWidth + i] += costCounter(integrator) - costBefore;
+                }
+            }
+        });
     }
 
-    static int imageCount = 11;
+    RenderStats stats;
+    for (const auto& integrator : integrators) {
+        stats.add(integrator.stats);
+    }
+    return stats;
+}
+
+void printRenderStats(const RenderStats& stats, long long pixels) {
+    cout << "Rays: " << stats.primaryRays << " primary, " << stats.shadowRays << " shadow, "
+         << stats.reflectionRays << " reflection" << endl;
+    cout << "Paths: " << stats.paths << ", average length " << stats.averagePathLength() << " segments, "
+         << stats.roulettePaths << " ended by roulette" << endl;
+    cout << "Shadow rays skipped: " << stats.coneSkippedRays << " outside spot cones, "
+         << stats.backfaceSkippedRays << " with no direct contribution" << endl;
+    cout << "Intersection tests:";
+    for (int kind = 0; kind < PRIM_KIND_COUNT; kind++) {
+        if (stats.intersectionTests[kind] == 0) continue;
+        cout << " " << primitiveKindNames[kind] << " " << stats.intersectionHits[kind] << "/" << stats.intersectionTests[kind];
+    }
+    cout << " (hits/tests)" << endl;
+    const PacketStats& packets = stats.packets;
+    if (packets.packets > 0) {
+        cout << "Packets: " << packets.packets << " traced, " << packets.splitPackets << " split ("
+             << (100.0 * packets.splitPackets / packets.packets) << "%), "
+             << packets.frustumCulled << "/" << packets.nodeVisits << " node visits frustum-culled, "
+             << packets.divergentNodes << " divergent" << endl;
+    }
+    if (maxPixelSamples > 1 && pixels > 0) {
+        cout << "Samples: " << (double)stats.pixelSamples / pixels << " per pixel on average, "
+             << stats.refinedPixels << "/" << pixels << " pixels refined (max " << maxPixelSamples << ")" << endl;
+    }
+}
+
+// A BMP records its file size in 32 bits, which wraps past about 37800
+// pixels square.
+bool bmpSizeFits(int width, int height, const string& path) {
+    if (54 + ((3LL * width + 3) & ~3LL) * height <= 0xFFFFFFFFLL) return true;
+    cerr << "Error: " << path << " is " << width << "x" << height
+         << ", too large for a BMP; stream a .ppm or .pfm instead" << endl;
+    return false;
+}
+
+// bitmap_image::save_image reports a failed open on stderr and nothing else,
+// so open the path first and check afterwards that the whole file landed.
+bool saveBitmap(const bitmap_image& image, const string& path) {
+    if (!bmpSizeFits(image.width(), image.height(), path)) return false;
+    long long expected = 54 + ((3LL * image.width() + 3) & ~3LL) * image.height();
+    bool saved = (bool)ofstream(path, ios::binary);
+    if (saved) {
+        image.save_image(path);
+        ifstream written(path, ios::binary | ios::ate);
+        saved = written && (long long)written.tellg() == expected;
+    }
+    if (!saved) cerr << "Error: Could not write " << path << endl;
+    return saved;
+}
+
+bool saveHeatmap(const vector<double>& pixelCost, int width, int height, const string& path) {
+    vector<double> sorted(pixelCost);
+    size_t rank = sorted.empty() ? 0 : (sorted.size() - 1) * 995 / 1000;
+    double maxCost = 0;
+    if (!sorted.empty()) {
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        maxCost = sorted[rank];
+    }
+
+    bitmap_image heatmap(width, height);
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            double cost = pixelCost[(size_t)j * width + i];
+            int index = maxCost > 0 ? (int)(999.0 * cost / maxCost) : 0;
+            heatmap.set_pixel(i, j, jet_colormap[std::max(0, std::min(999, index))]);
+        }
+    }
+    if (!saveBitmap(heatmap, path)) return false;
+    cout << "Heatmap saved as " << path << " (scale 0-" << maxCost << (heatmapNanoseconds ? " ns" : " tests") << " per pixel, 99.5th percentile)" << endl;
+    return true;
+}
+
+enum ImageFormat {
+    FORMAT_BMP,
+    FORMAT_PPM,
+    FORMAT_PFM
+};
+
+ImageFormat formatOf(const string& path) {
+    string extension = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+    if (extension == ".ppm") return FORMAT_PPM;
+    if (extension == ".pfm") return FORMAT_PFM;
+    return FORMAT_BMP;
+}
+
+void putLittleEndian(unsigned char* out, unsigned int value) {
+    for (int b = 0; b < 4; b++) out[b] = (unsigned char)(value >> (8 * b));
+}
+
+void toneMapImage(const HdrImage& hdr, bitmap_image& image) {
+    double scale = pow(2.0, exposure);
+    for (int j = 0; j < hdr.height; j++) {
+        for (int i = 0; i < hdr.width; i++) {
+            const float* color = hdr.at(i, j);
+            image.set_pixel(i, j,
+                toneMapChannel(color[0], toneMapOperator, scale),
+                toneMapChannel(color[1], toneMapOperator, scale),
+                toneMapChannel(color[2], toneMapOperator, scale));
+        }
+    }
+}
+
+// Writes rows at fixed offsets, so bands may arrive in any order. BMP and PFM
+// store rows bottom-up, PPM top-down.
+class StreamingImageWriter {
+public:
+    StreamingImageWriter(const string& path, int width, int height) : width(width), height(height) {
+        format = formatOf(path);
+        if (format == FORMAT_BMP && !bmpSizeFits(width, height, path)) {
+            file.setstate(ios::failbit);
+            return;
+        }
+        file.open(path, ios::binary);
+        if (!file) return;
+
+        if (format == FORMAT_BMP) {
+            headerSize = 54;
+            rowStride = (3LL * width + 3) & ~3LL;
+            unsigned int imageSize = (unsigned int)(rowStride * height);
+            unsigned char header[54] = {'B', 'M'};
+            putLittleEndian(header + 2, (unsigned int)(headerSize + imageSize));
+            putLittleEndian(header + 10, (unsigned int)headerSize);
+            putLittleEndian(header + 14, 40);
+            putLittleEndian(header + 18, (unsigned int)width);
+            putLittleEndian(header + 22, (unsigned int)height);
+            header[26] = 1;
+            header[28] = 24;
+            putLittleEndian(header + 34, imageSize);
+            file.write(reinterpret_cast<const char*>(header), sizeof(header));
+            return;
+        }
+
+        ostringstream header;
+        if (format == FORMAT_PPM) {
+            header << "P6\n" << width << " " << height << "\n255\n";
+            rowStride = 3LL * width;
+        } else {
+            header << "PF\n" << width << " " << height << "\n-1.0\n";
+            rowStride = 12LL * width;
+        }
+        headerSize = (long long)header.str().size();
+        file << header.str();
+    }
+
+    bool isOpen() const {
+        return file.good();
+    }
+
+    void writeRows(const HdrImage& band, int bandRow, int firstRow, int rowCount) {
+        double scale = pow(2.0, exposure);
+        vector<unsigned char> row(rowStride, 0);
+        for (int k = 0; k < rowCount; k++) {
+            for (int i = 0; i < width; i++) {
+                const float* color = band.at(i, bandRow + k);
+                if (format == FORMAT_PFM) {
+                    for (int c = 0; c < 3; c++) {
+                        unsigned int bits;
+                        memcpy(&bits, &color[c], sizeof(bits));
+                        putLittleEndian(&row[12 * i + 4 * c], bits);
+                    }
+                } else {
+                    int red = format == FORMAT_PPM ? 0 : 2;
+                    row[3 * i + red] = toneMapChannel(color[0], toneMapOperator, scale);
+                    row[3 * i + 1] = toneMapChannel(color[1], toneMapOperator, scale);
+                    row[3 * i + 2 - red] = toneMapChannel(color[2], toneMapOperator, scale);
+                }
+            }
+
+            int j = firstRow + k;
+            long long fileRow = format == FORMAT_PPM ? j : height - 1 - j;
+            file.seekp(headerSize + fileRow * rowStride);
+            file.write(reinterpret_cast<const char*>(row.data()), rowStride);
+        }
+    }
+
+private:
+    int width, height;
+    ImageFormat format;
+    long long headerSize = 0, rowStride = 0;
+    ofstream file;
+};
+
+bool savePfm(const HdrImage& image, const string& path) {
+    StreamingImageWriter writer(path, image.width, image.height);
+    if (writer.isOpen()) writer.writeRows(image, 0, 0, image.height);
+    if (!writer.isOpen()) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+bool loadPfm(const string& path, HdrImage& image) {
+    ifstream file(path, ios::binary);
+    string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    file >> magic >> width >> height >> scale;
+    file.get();
+    if (!file || (magic != "PF" && magic != "Pf") || width <= 0 || height <= 0) {
+        cerr << "Error: " << path << " is not a readable PFM file" << endl;
+        return false;
+    }
+
+    int channels = magic == "PF" ? 3 : 1;
+    image = HdrImage(width, height);
+    vector<unsigned char> row(4 * (size_t)channels * width);
+    for (int j = height - 1; j >= 0; j--) {
+        if (!file.read(reinterpret_cast<char*>(row.data()), row.size())) {
+            cerr << "Error: " << path << " is truncated" << endl;
+            return false;
+        }
+        for (int i = 0; i < width; i++) {
+            for (int c = 0; c < 3; c++) {
+                const unsigned char* bytes = &row[4 * (i * channels + (channels == 3 ? c : 0))];
+                unsigned int bits = scale < 0 ? bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned int)bytes[3] << 24
+                                              : bytes[3] | bytes[2] << 8 | bytes[1] << 16 | (unsigned int)bytes[0] << 24;
+                memcpy(&image.at(i, j)[c], &bits, sizeof(bits));
+            }
+        }
+    }
+    return true;
+}
+
+bool streamCapture(const string& path) {
+    int width = imageResolution, height = imageResolution;
+    StreamingImageWriter writer(path, width, height);
+    if (!writer.isOpen()) {
+        cerr << "Error: Could not open " << path << " for writing" << endl;
+        return false;
+    }
+    std::unique_ptr<StreamingImageWriter> pfmWriter;
+    if (!pfmPath.empty()) pfmWriter.reset(new StreamingImageWriter(pfmPath, width, height));
+    if (!heatmapPath.empty()) {
+        cerr << "Warning: --heatmap needs the whole frame and is ignored when streaming" << endl;
+    }
+
+    int halo = maxPixelSamples > 1 ? 1 : 0;
+    int bandRows = 32 * std::max(4, WorkStealingPool::resolveThreads(renderThreads));
+    RenderStats stats;
+    for (int y0 = 0; y0 < height; y0 += bandRows) {
+        int y1 = std::min(height, y0 + bandRows);
+        int top = std::max(0, y0 - halo), bottom = std::min(height, y1 + halo);
+        HdrImage band(width, bottom - top);
+        stats.add(renderImage(band, false, nullptr, top, height));
+        writer.writeRows(band, y0 - top, y0, y1 - y0);
+        if (pfmWriter) pfmWriter->writeRows(band, y0 - top, y0, y1 - y0);
+    }
+    printRenderStats(stats, (long long)width * height);
+    if (pfmWriter && pfmWriter->isOpen()) cout << "Float buffer streamed to " << pfmPath << endl;
+    return writer.isOpen();
+}
+
+bool toneMapPfm(const string& inputPath, const string& outputPath) {
+    HdrImage hdr;
+    if (!loadPfm(inputPath, hdr)) return false;
+
+    string path = outputPath.empty() ? "tonemapped.bmp" : outputPath;
+    if (formatOf(path) != FORMAT_BMP) {
+        StreamingImageWriter writer(path, hdr.width, hdr.height);
+        if (writer.isOpen()) writer.writeRows(hdr, 0, 0, hdr.height);
+        if (!writer.isOpen()) {
+            cerr << "Error: Could not write " << path << endl;
+            return false;
+        }
+    } else {
+        bitmap_image image(hdr.width, hdr.height);
+        toneMapImage(hdr, image);
+        if (!saveBitmap(image, path)) return false;
+    }
+    cout << "Tone-mapped " << inputPath << " to " << path << endl;
+    return true;
+}
+
+// Compares two renders channel by channel, e.g. a single-precision build
+// against the double reference, and fails when the RMSE in 8-bit steps
+// exceeds the tolerance.
+bool compareImages(const string& referencePath, const string& testPath, double tolerance) {
+    bitmap_image reference(referencePath), test(testPath);
+    if (!reference || !test) return false;
+    if (reference.width() != test.width() || reference.height() != test.height()) {
+        cerr << "Error: " << referencePath << " and " << testPath << " differ in size" << endl;
+        return false;
+    }
+
+    double squaredError = 0;
+    int maxDifference = 0;
+    long long differing = 0;
+    for (unsigned int y = 0; y < reference.height(); y++) {
+        for (unsigned int x = 0; x < reference.width(); x++) {
+            rgb_t a = reference.get_pixel(x, y), b = test.get_pixel(x, y);
+            int d[3] = {abs(a.red - b.red), abs(a.green - b.green), abs(a.blue - b.blue)};
+            if (d[0] || d[1] || d[2]) differing++;
+            for (int c = 0; c < 3; c++) {
+                squaredError += d[c] * d[c];
+                maxDifference = max(maxDifference, d[c]);
+            }
+        }
+    }
+    long long pixels = (long long)reference.width() * reference.height();
+    double rmse = sqrt(squaredError / (3.0 * pixels));
+    cout << "RMSE " << rmse << ", max difference " << maxDifference << ", "
+         << (100.0 * differing / pixels) << "% of pixels differ" << endl;
+    return rmse <= tolerance;
+}
+
+bool capture(const string& outputPath = "") {
     std::ostringstream filename;
-    filename << "Output_" << imageCount++ << ".bmp";
-    image.save_image(filename.str());
+    if (outputPath.empty()) {
+        filename << "Output_" << imageCount++ << ".bmp";
+    } else {
+        filename << outputPath;
+    }
+
+    if (streamOutput) {
+        if (!streamCapture(filename.str())) return false;
+        std::cout << "Image streamed to " << filename.str() << std::endl;
+        return true;
+    }
+    if (!bmpSizeFits(imageResolution, imageResolution, filename.str())) return false;
+
+    HdrImage hdr(imageResolution, imageResolution);
+    vector<double> pixelCost;
+    RenderStats stats = renderImage(hdr, false, heatmapPath.empty() ? nullptr : &pixelCost);
+    printRenderStats(stats, (long long)imageResolution * imageResolution);
+    bool saved = true;
+    if (!heatmapPath.empty()) saved = saveHeatmap(pixelCost, imageResolution, imageResolution, heatmapPath);
+    if (!pfmPath.empty()) {
+        if (savePfm(hdr, pfmPath)) std::cout << "Float buffer saved as " << pfmPath << std::endl;
+        else saved = false;
+    }
+
+    bitmap_image image(imageResolution, imageResolution);
+    toneMapImage(hdr, image);
+    if (!saveBitmap(image, filename.str())) return false;
     std::cout << "Image saved as " << filename.str() << std::endl;
+    return saved;
+}
+
+class ProgressiveRenderer {
+public:
+    static const int COARSEST_STEP = 16;
+
+    int width = 0, height = 0;
+    int passesDone = 0;
+    bool active = false;
+
+    ~ProgressiveRenderer() {
+        stop();
+    }
+
+    void restart(int width, int height) {
+        stop();
+        this->width = width;
+        this->height = height;
+        pixels.assign(3 * (size_t)width * height, 0);
+        {
+            std::lock_guard<std::mutex> guard(frameLock);
+            frame.assign(pixels.size(), 0);
+            framePasses = 0;
+        }
+        passesDone = 0;
+        cancelled = false;
+        worker = std::thread(&ProgressiveRenderer::run, this, PinholeCamera(width, height));
+    }
+
+    void stop() {
+        cancelled = true;
+        if (worker.joinable()) worker.join();
+    }
+
+    bool takeFrame(std::vector<unsigned char>& out) {
+        std::lock_guard<std::mutex> guard(frameLock);
+        if (framePasses == passesDone) return false;
+        out = frame;
+        passesDone = framePasses;
+        return true;
+    }
+
+    static int passCount() {
+        int passes = 1;
+        for (int step = COARSEST_STEP; step > 1; step /= 2) passes++;
+        return passes;
+    }
+
+private:
+    std::vector<unsigned char> pixels;
+    std::vector<unsigned char> frame;
+    int framePasses = 0;
+    std::mutex frameLock;
+    std::atomic<bool> cancelled{false};
+    std::thread worker;
+
+    void run(PinholeCamera camera) {
+        const int tileSize = 32;
+        int tilesX = (width + tileSize - 1) / tileSize;
+        int tilesY = (height + tileSize - 1) / tileSize;
+        WorkStealingPool pool(renderThreads);
+        std::vector<Integrator> integrators(pool.threadCount);
+        double scale = pow(2.0, exposure);
+
+        int pass = 0;
+        for (int step = COARSEST_STEP; step >= 1 && !cancelled; step /= 2) {
+            pool.run(tilesX * tilesY, [&](int tile, int worker) {
+                int x0 = (tile % tilesX) * tileSize;
+                int y0 = (tile / tilesX) * tileSize;
+                int x1 = std::min(width, x0 + tileSize);
+                int y1 = std::min(height, y0 + tileSize);
+
+                for (int j = y0; j < y1 && !cancelled; j += step) {
+                    for (int i = x0; i < x1; i += step) {
+                        bool traced = step < COARSEST_STEP && i % (2 * step) == 0 && j % (2 * step) == 0;
+                        if (traced) continue;
+
+                        Ray ray = camera.primaryRay(i, j);
+                        double pixelColor[3] = {0, 0, 0};
+                        integrators[worker].beginSample(i, j, 0);
+                        integrators[worker].trace(&ray, pixelColor, 1);
+
+                        unsigned char rgb[3];
+                        for (int c = 0; c < 3; c++) {
+                            rgb[c] = toneMapChannel(pixelColor[c], toneMapOperator, scale);
+                        }
+                        for (int bj = j; bj < std::min(y1, j + step); bj++) {
+                            for (int bi = i; bi < std::min(x1, i + step); bi++) {
+                                memcpy(&pixels[3 * ((size_t)bj * width + bi)], rgb, 3);
+                            }
+                        }
+                    }
+                }
+            });
+            if (cancelled) return;
+
+            std::lock_guard<std::mutex> guard(frameLock);
+            frame = pixels;
+            framePasses = ++pass;
+        }
+    }
+};
+
+ProgressiveRenderer progressive;
+GLuint previewTexture = 0;
+
+struct SceneRandom {
+    unsigned long long state;
+
+    SceneRandom(unsigned long long seed) : state(seed) {}
+
+    double next(double lo, double hi) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return lo + (hi - lo) * ((state >> 11) * (1.0 / 9007199254740992.0));
+    }
+};
+
+string generateManyLightsScene() {
+    ostringstream scene;
+    scene << "3\n512\n8\n";
+    scene << "sphere\n40 0 10\n10\n0 1 0\n0.4 0.2 0.2 0.2\n10\n";
+    scene << "sphere\n-30 60 20\n20\n0 0 1\n0.2 0.2 0.4 0.2\n15\n";
+    scene << "sphere\n-15 15 45\n15\n1 1 0\n0.4 0.3 0.1 0.2\n5\n";
+    scene << "sphere\n80 80 30\n30\n1 0.5 0.2\n0.3 0.4 0.2 0.1\n20\n";
+    scene << "sphere\n-90 -20 25\n25\n0.6 0.6 0.9\n0.3 0.4 0.2 0.1\n20\n";
+    scene << "triangle\n50 30 0\n70 60 0\n50 45 50\n1 0 0\n0.4 0.2 0.1 0.3\n5\n";
+    scene << "triangle\n70 60 0\n30 60 0\n50 45 50\n0 1 0\n0.4 0.2 0.1 0.3\n5\n";
+    scene << "general\n1 1 1 0 0 0 0 0 0 -100\n0 0 0 0 0 20\n0 1 0\n0.4 0.2 0.1 0.3\n10\n";
+
+    const int pointCount = 64, spotCount = 16;
+    scene << pointCount << "\n";
+    for (int i = 0; i < pointCount; i++) {
+        double angle = 2.0 * M_PI * i / pointCount;
+        scene << 150 * cos(angle) << " " << 150 * sin(angle) << " " << 80 + 70 * (i % 2) << "\n";
+        scene << 0.05 + 0.1 * (i % 3 == 0) << " " << 0.05 + 0.1 * (i % 3 == 1) << " " << 0.05 + 0.1 * (i % 3 == 2) << "\n";
+    }
+    scene << spotCount << "\n";
+    for (int i = 0; i < spotCount; i++) {
+        double angle = 2.0 * M_PI * i / spotCount;
+        scene << 100 * cos(angle) << " " << 100 * sin(angle) << " 250\n";
+        scene << "0.2 0.2 0.2\n";
+        scene << -cos(angle) * 0.3 << " " << -sin(angle) * 0.3 << " -1\n";
+        scene << "25\n";
+    }
+    return scene.str();
+}
+
+string generateMirrorScene() {
+    ostringstream scene;
+    const int ringCount = 8;
+    scene << "12\n512\n" << ringCount + 3 << "\n";
+    for (int i = 0; i < ringCount; i++) {
+        double angle = 2.0 * M_PI * i / ringCount;
+        scene << "sphere\n" << 110 * cos(angle) << " 0 " << 200 + 110 * sin(angle) << "\n45\n";
+        scene << 0.5 + 0.5 * cos(angle) << " " << 0.5 + 0.5 * sin(angle) << " 0.8\n";
+        scene << "0.05 0.1 0.1 0.9\n50\n";
+    }
+    scene << "sphere\n0 0 200\n50\n0.9 0.9 0.9\n0.05 0.05 0.1 0.95\n80\n";
+    scene << "triangle\n-400 150 0\n400 150 0\n400 150 500\n0.8 0.8 0.8\n0.05 0.05 0.05 0.9\n10\n";
+    scene << "triangle\n-400 150 0\n400 150 500\n-400 150 500\n0.8 0.8 0.8\n0.05 0.05 0.05 0.9\n10\n";
+    scene << "2\n0 -150 300\n1 1 1\n100 -100 150\n0.5 0.5 0.8\n";
+    scene << "0\n";
+    return scene.str();
+}
+
+string generateTriangleSoupScene(int triangleCount) {
+    ostringstream scene;
+    SceneRandom random(2005063);
+    scene << "2\n512\n" << triangleCount << "\n";
+    for (int i = 0; i < triangleCount; i++) {
+        double cx = random.next(-150, 150), cy = random.next(-50, 250), cz = random.next(5, 200);
+        scene << "triangle\n";
+        for (int k = 0; k < 3; k++) {
+            scene << cx + random.next(-3, 3) << " " << cy + random.next(-3, 3) << " " << cz + random.next(-3, 3) << "\n";
+        }
+        scene << random.next(0, 1) << " " << random.next(0, 1) << " " << random.next(0, 1) << "\n";
+        scene << "0.4 0.3 0.2 0.1\n10\n";
+    }
+    scene << "2\n100 -100 300\n1 1 1\n-150 50 250\n0.4 0.4 0.6\n";
+    scene << "0\n";
+    return scene.str();
+}
+
+struct BenchmarkCase {
+    string name;
+    string scenePath;
+    string sceneText;
+    int resolution;
+};
+
+int runBenchmark(const RenderOptions& options) {
+    vector<BenchmarkCase> cases = {
+        {"shipped", options.scenePath, "", 1000},
+        {"many_lights", "", generateManyLightsScene(), 512},
+        {"deep_mirror", "", generateMirrorScene(), 512},
+        {"triangles_100k", "", generateTriangleSoupScene(100000), 512},
+    };
+
+    ostringstream json;
+    json << "{\n  \"threads\": " << WorkStealingPool::resolveThreads(renderThreads) << ",\n";
+    json << "  \"packets\": " << (packetTracing ? "true" : "false") << ",\n";
+    json << "  \"max_samples\": " << maxPixelSamples << ",\n";
+    json << "  \"scenes\": [";
+
+    for (size_t c = 0; c < cases.size(); c++) {
+        const BenchmarkCase& bench = cases[c];
+        clearScene();
+
+        double loadTime = 0, buildTime = 0, renderTime = 0, writeTime = 0, wallTime = 0;
+        RenderStats stats;
+        {
+            ScopedTimer wall(&wallTime);
+            bool loaded;
+            {
+                ScopedTimer timer(&loadTime);
+                if (bench.sceneText.empty()) {
+                    loaded = loadData(bench.scenePath);
+                } else {
+                    istringstream sceneText(bench.sceneText);
+                    loaded = loadScene(sceneText);
+                }
+            }
+            if (!loaded) {
+                cerr << "Benchmark: could not load scene " << bench.name << endl;
+                return 1;
+            }
+            if (!scenePrebuilt) {
+                ScopedTimer timer(&buildTime);
+                sceneBVH.build(objects);
+            }
+
+            HdrImage hdr(bench.resolution, bench.resolution);
+            {
+                ScopedTimer timer(&renderTime);
+                stats = renderImage(hdr, true);
+            }
+            {
+                ScopedTimer timer(&writeTime);
+                bitmap_image image(bench.resolution, bench.resolution);
+                toneMapImage(hdr, image);
+                if (!saveBitmap(image, "benchmark_" + bench.name + ".bmp")) return 1;
+            }
+        }
+
+        double raysPerSecond = renderTime > 0 ? stats.totalRays() / renderTime : 0;
+        cout << bench.name << ": " << bench.resolution << "x" << bench.resolution << ", "
+             << wallTime << " s wall, " << renderTime << " s render, "
+             << raysPerSecond / 1e6 << " Mrays/s" << endl;
+
+        json << (c ? "," : "") << "\n    {\n";
+        json << "      \"name\": \"" << bench.name << "\",\n";
+        json << "      \"resolution\": " << bench.resolution << ",\n";
+        json << "      \"objects\": " << objects.size() << ",\n";
+        json << "      \"point_lights\": " << pointLights.size() << ",\n";
+        json << "      \"spot_lights\": " << spotLights.size() << ",\n";
+        json << "      \"recursion_level\": " << recursionLevel << ",\n";
+        json << "      \"average_path_length\": " << stats.averagePathLength() << ",\n";
+        json << "      \"wall_seconds\": " << wallTime << ",\n";
+        json << "      \"render_seconds\": " << renderTime << ",\n";
+        json << "      \"rays\": {\"primary\": " << stats.primaryRays << ", \"shadow\": " << stats.shadowRays
+             << ", \"reflection\": " << stats.reflectionRays << ", \"total\": " << stats.totalRays()
+             << ", \"shadow_skipped_cone\": " << stats.coneSkippedRays
+             << ", \"shadow_skipped_backface\": " << stats.backfaceSkippedRays << "},\n";
+        json << "      \"intersections\": {";
+        for (int kind = 0; kind < PRIM_KIND_COUNT; kind++) {
+            json << (kind ? ", " : "") << "\"" << primitiveKindNames[kind] << "\": {\"tests\": " << stats.intersectionTests[kind]
+                 << ", \"hits\": " << stats.intersectionHits[kind] << "}";
+        }
+        json << "},\n";
+        json << "      \"rays_per_second\": " << raysPerSecond << ",\n";
+        json << "      \"samples_per_pixel\": " << (double)stats.pixelSamples / ((double)bench.resolution * bench.resolution) << ",\n";
+        json << "      \"stages\": {\"load\": " << loadTime << ", \"build\": " << buildTime
+             << ", \"primary\": " << stats.primaryTime << ", \"shadow\": " << stats.shadowTime
+             << ", \"reflection\": " << stats.reflectionTime << ", \"image_write\": " << writeTime << "}\n";
+        json << "    }";
+    }
+    json << "\n  ]\n}\n";
+
+    string jsonPath = options.outputPath.empty() ? "benchmark.json" : options.outputPath;
+    ofstream out(jsonPath);
+    if (!out.is_open()) {
+        cerr << "Error: Could not write " << jsonPath << endl;
+        return 1;
+    }
+    out << json.str();
+    cout << "Benchmark results written to " << jsonPath << endl;
+    clearScene();
+    return 0;
+}
+
+// Times ray/triangle tests over a random soup four ways: rebuilding the edges
+// on every call (the old Triangle path), the precomputed Triangle, and the
+// packed SIMD kernels in Moller-Trumbore and watertight form. Then aims rays
+// exactly at the shared edges and vertices of a rotated grid and counts the
+// ones that fall through the cracks.
+int runTriangleBenchmark(int triangleCount) {
+    SceneRandom random(2005063);
+    vector<Triangle> triangles;
+    triangles.reserve(triangleCount);
+    for (int i = 0; i < triangleCount; i++) {
+        double cx = random.next(-150, 150), cy = random.next(-50, 250), cz = random.next(5, 200);
+        Vector3D p[3];
+        for (int k = 0; k < 3; k++) {
+            p[k] = Vector3D(cx + random.next(-3, 3), cy + random.next(-3, 3), cz + random.next(-3, 3));
+        }
+        triangles.emplace_back(p[0], p[1], p[2]);
+    }
+
+    const int rayCount = 256;
+    vector<Ray> rays;
+    for (int i = 0; i < rayCount; i++) {
+        Vector3D origin(random.next(-200, 200), -300, random.next(0, 300));
+        const Triangle& target = triangles[i * 7919 % triangleCount];
+        rays.emplace_back(Vector3<double>(origin), Vector3<double>(target.points[0] + target.edge1 * 0.3 + target.edge2 * 0.3 - origin));
+    }
+
+    PackedPrimitives packed, watertight;
+    watertight.watertight = true;
+    packed.resize(triangleCount);
+    watertight.resize(triangleCount);
+    for (int i = 0; i < triangleCount; i++) {
+        triangles[i].pack(packed, i);
+        triangles[i].pack(watertight, i);
+    }
+
+    struct Variant {
+        const char* name;
+        std::function<double(const Ray&)> nearest;
+    };
+    vector<Variant> variants = {
+        {"recomputed edges", [&](const Ray& ray) {
+            double tNearest = std::numeric_limits<double>::infinity();
+            for (const Triangle& triangle : triangles) {
+                Vector3<double> p0(triangle.points[0]), p1(triangle.points[1]), p2(triangle.points[2]);
+                Vector3<double> edge1 = p1 - p0;
+                Vector3<double> edge2 = p2 - p0;
+                Vector3<double> h = cross(ray.dir, edge2);
+                double a = dot(edge1, h);
+                if (fabs(a) < 1e-6) continue;
+
+                double f = 1.0 / a;
+                Vector3<double> s = ray.start - p0;
+                double u = f * dot(s, h);
+                if (u < 0.0 || u > 1.0) continue;
+
+                Vector3<double> q = cross(s, edge1);
+                double v = f * dot(ray.dir, q);
+                if (v < 0.0 || u + v > 1.0) continue;
+
+                double t = f * dot(edge2, q);
+                if (t > 0 && t < tNearest) tNearest = t;
+            }
+            return tNearest;
+        }},
+        {"precomputed", [&](const Ray& ray) {
+            Ray probe = ray;
+            double tNearest = std::numeric_limits<double>::infinity();
+            for (Triangle& triangle : triangles) {
+                double t = triangle.Triangle::intersect(&probe);
+                if (t > 0 && t < tNearest) tNearest = t;
+            }
+            return tNearest;
+        }},
+        {"packed simd", [&](const Ray& ray) {
+            double tNearest = std::numeric_limits<double>::infinity();
+            int hitIndex = -1;
+            intersectPacked<PRIM_TRIANGLE>(packed, 0, triangleCount, ray, tNearest, hitIndex);
+            return tNearest;
+        }},
+        {"packed watertight", [&](const Ray& ray) {
+            double tNearest = std::numeric_limits<double>::infinity();
+            int hitIndex = -1;
+            intersectPacked<PRIM_TRIANGLE>(watertight, 0, triangleCount, ray, tNearest, hitIndex);
+            return tNearest;
+        }},
+    };
+
+    cout << "Triangle soup: " << triangleCount << " triangles, " << rayCount << " rays" << endl;
+    for (const Variant& variant : variants) {
+        double seconds = 0, checksum = 0;
+        int hits = 0;
+        {
+            ScopedTimer timer(&seconds);
+            for (int i = 0; i < rayCount; i++) {
+                double t = variant.nearest(rays[i]);
+                if (t < std::numeric_limits<double>::infinity()) {
+                    hits++;
+                    checksum += t;
+                }
+            }
+        }
+        cout << "  " << variant.name << ": " << seconds * 1e9 / ((double)rayCount * triangleCount) << " ns/test, "
+             << hits << " hits, checksum " << checksum << endl;
+    }
+
+    const int gridSize = 64;
+    const double angle = 0.37;
+    Vector3D axisU(cos(angle), sin(angle) * 0.6, sin(angle) * 0.8), axisV(-sin(angle), cos(angle) * 0.6, cos(angle) * 0.8);
+    Vector3D corner(13.1, -7.3, 2.9);
+    auto gridPoint = [&](double u, double v) { return corner + axisU * (u * 0.731) + axisV * (v * 0.731); };
+
+    PackedPrimitives gridPacked, gridWatertight;
+    gridWatertight.watertight = true;
+    int gridTriangles = 2 * gridSize * gridSize;
+    gridPacked.resize(gridTriangles);
+    gridWatertight.resize(gridTriangles);
+    for (int j = 0, index = 0; j < gridSize; j++) {
+        for (int i = 0; i < gridSize; i++, index += 2) {
+            Vector3D a = gridPoint(i, j), b = gridPoint(i + 1, j), c = gridPoint(i + 1, j + 1), d = gridPoint(i, j + 1);
+            gridPacked.setTriangle(index, a, b, c);
+            gridPacked.setTriangle(index + 1, a, c, d);
+            gridWatertight.setTriangle(index, a, b, c);
+            gridWatertight.setTriangle(index + 1, a, c, d);
+        }
+    }
+
+    int probes = 0, leaks = 0, watertightLeaks = 0;
+    Vector3D eye = gridPoint(gridSize / 2, gridSize / 2) + Vector3D(3.7, -41.3, 57.1);
+    for (int j = 1; j < gridSize; j++) {
+        for (int i = 1; i < gridSize; i++) {
+            // A shared vertex, the two axis edges, and the diagonal.
+            Vector3D targets[4] = {gridPoint(i, j), gridPoint(i + 0.5, j), gridPoint(i, j + 0.5), gridPoint(i - 0.5, j - 0.5)};
+            for (const Vector3D& target : targets) {
+                Ray ray(Vector3<double>(eye), Vector3<double>(target - eye));
+                double tNearest = std::numeric_limits<double>::infinity();
+                int hitIndex = -1;
+                intersectPacked<PRIM_TRIANGLE>(gridPacked, 0, gridTriangles, ray, tNearest, hitIndex);
+                if (hitIndex < 0) leaks++;
+                tNearest = std::numeric_limits<double>::infinity();
+                hitIndex = -1;
+                intersectPacked<PRIM_TRIANGLE>(gridWatertight, 0, gridTriangles, ray, tNearest, hitIndex);
+                if (hitIndex < 0) watertightLeaks++;
+                probes++;
+            }
+        }
+    }
+    cout << "Shared-edge probes: " << probes << ", leaks " << leaks << " (moller-trumbore), "
+         << watertightLeaks << " (watertight)" << endl;
+    return 0;
 }
 
 void drawAxes() {
@@ -233,8 +1973,62 @@ void drawLightSources() {
     }
 }
 
+void drawPreview() {
+    std::vector<unsigned char> frame;
+    if (progressive.takeFrame(frame)) {
+        glBindTexture(GL_TEXTURE_2D, previewTexture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, progressive.width, progressive.height, 0, GL_RGB, GL_UNSIGNED_BYTE, frame.data());
+    }
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, 1, 0, 1, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, previewTexture);
+    glColor3f(1, 1, 1);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 1); glVertex2f(0, 0);
+    glTexCoord2f(1, 1); glVertex2f(1, 0);
+    glTexCoord2f(1, 0); glVertex2f(1, 1);
+    glTexCoord2f(0, 0); glVertex2f(0, 1);
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_DEPTH_TEST);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+void restartPreview() {
+    if (!progressive.active) return;
+    progressive.restart(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+}
+
+void previewTimer(int value) {
+    if (progressive.active) {
+        std::ostringstream title;
+        title << "Ray Tracer OpenGL Viewer - preview pass " << progressive.passesDone << "/" << ProgressiveRenderer::passCount();
+        glutSetWindowTitle(title.str().c_str());
+        glutPostRedisplay();
+    }
+    glutTimerFunc(50, previewTimer, 0);
+}
+
 void display() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (progressive.active) {
+        drawPreview();
+        glutSwapBuffers();
+        return;
+    }
+
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 
@@ -255,46 +2049,22 @@ void display() {
 }
 
 void updateCameraVectorsWithTilt() {
-    double length = sqrt(cameraLookDir.x * cameraLookDir.x + cameraLookDir.y * cameraLookDir.y + cameraLookDir.z * cameraLookDir.z);
-    cameraLookDir.x /= length;
-    cameraLookDir.y /= length;
-    cameraLookDir.z /= length;
-    
-    length = sqrt(cameraRight.x * cameraRight.x + cameraRight.y * cameraRight.y + cameraRight.z * cameraRight.z);
-    cameraRight.x /= length;
-    cameraRight.y /= length;
-    cameraRight.z /= length;
-    
-    length = sqrt(cameraUp.x * cameraUp.x + cameraUp.y * cameraUp.y + cameraUp.z * cameraUp.z);
-    cameraUp.x /= length;
-    cameraUp.y /= length;
-    cameraUp.z /= length;
+    cameraLookDir = normalize(cameraLookDir);
+    cameraRight = normalize(cameraRight);
+    cameraUp = normalize(cameraUp);
 }
 
 void updateCameraVectors() {
-    double length = sqrt(cameraLookDir.x * cameraLookDir.x + cameraLookDir.y * cameraLookDir.y + cameraLookDir.z * cameraLookDir.z);
-    cameraLookDir.x /= length;
-    cameraLookDir.y /= length;
-    cameraLookDir.z /= length;
-    
+    cameraLookDir = normalize(cameraLookDir);
     Vector3D worldUp(0, 0, 1);
-    cameraRight.x = cameraLookDir.y * worldUp.z - cameraLookDir.z * worldUp.y;
-    cameraRight.y = cameraLookDir.z * worldUp.x - cameraLookDir.x * worldUp.z;
-    cameraRight.z = cameraLookDir.x * worldUp.y - cameraLookDir.y * worldUp.x;
-    
-    length = sqrt(cameraRight.x * cameraRight.x + cameraRight.y * cameraRight.y + cameraRight.z * cameraRight.z);
-    cameraRight.x /= length;
-    cameraRight.y /= length;
-    cameraRight.z /= length;
-    
-    cameraUp.x = cameraRight.y * cameraLookDir.z - cameraRight.z * cameraLookDir.y;
-    cameraUp.y = cameraRight.z * cameraLookDir.x - cameraRight.x * cameraLookDir.z;
-    cameraUp.z = cameraRight.x * cameraLookDir.y - cameraRight.y * cameraLookDir.x;
+    cameraRight = normalize(cross(cameraLookDir, worldUp));
+    cameraUp = cross(cameraRight, cameraLookDir);
 }
 
 void keyboardListener(unsigned char key, int x, int y) {
     const double ROTATE_SPEED = 0.1;
-    
+
+    progressive.stop();
     switch (key) {
         case '1':
             {
@@ -320,21 +2090,13 @@ void keyboardListener(unsigned char key, int x, int y) {
             break;
         case '3':
             {
-                Vector3D temp = cameraLookDir + cameraUp * ROTATE_SPEED;
-                double length = sqrt(temp.x * temp.x + temp.y * temp.y + temp.z * temp.z);
-                cameraLookDir.x = temp.x / length;
-                cameraLookDir.y = temp.y / length;
-                cameraLookDir.z = temp.z / length;
+                cameraLookDir = normalize(cameraLookDir + cameraUp * ROTATE_SPEED);
                 updateCameraVectors();
             }
             break;
         case '4':
             {
-                Vector3D temp = cameraLookDir - cameraUp * ROTATE_SPEED;
-                double length = sqrt(temp.x * temp.x + temp.y * temp.y + temp.z * temp.z);
-                cameraLookDir.x = temp.x / length;
-                cameraLookDir.y = temp.y / length;
-                cameraLookDir.z = temp.z / length;
+                cameraLookDir = normalize(cameraLookDir - cameraUp * ROTATE_SPEED);
                 updateCameraVectors();
             }
             break;
@@ -368,15 +2130,22 @@ void keyboardListener(unsigned char key, int x, int y) {
                 cout << "Floor texture toggled. Current mode: " << (globalFloor->useTexture ? "Texture" : "Checkerboard") << endl;
             }
             break;
+        case 'p':
+            progressive.active = !progressive.active;
+            if (!progressive.active) glutSetWindowTitle("Ray Tracer OpenGL Viewer");
+            cout << "Progressive preview " << (progressive.active ? "on" : "off") << endl;
+            break;
         default:
             break;
     }
+    restartPreview();
     glutPostRedisplay();
 }
 
 void specialKeyListener(int key, int x, int y) {
     const double moveSpeed = 20.0;
-    
+
+    progressive.stop();
     switch (key) {
         case GLUT_KEY_UP:
             cameraPos = cameraPos + cameraLookDir * moveSpeed;
@@ -399,6 +2168,7 @@ void specialKeyListener(int key, int x, int y) {
         default:
             break;
     }
+    restartPreview();
     glutPostRedisplay();
 }
 
@@ -408,28 +2178,236 @@ void init() {
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     gluPerspective(70, 1, 0.1, 10000);
+
+    glGenTextures(1, &previewTexture);
+    glBindTexture(GL_TEXTURE_2D, previewTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+void printUsage(const char* program) {
+    cerr << "Usage: " << program << " [options]" << endl
+         << "  --batch                 render straight to disk without opening a window" << endl
+         << "  --benchmark             render the fixed benchmark scenes and write JSON timings to --output" << endl
+         << "  --scene PATH            scene description, text or binary (default scene.txt)" << endl
+         << "  --convert PATH          write --scene as a binary scene with a prebuilt BVH and exit" << endl
+         << "  --output PATH           output bitmap (default Output_<n>.bmp)" << endl
+         << "  --resolution N          image width and height (default from the scene)" << endl
+         << "  --threads, -j N         render threads (default: all cores)" << endl
+         << "  --bench-triangles N     time the ray/triangle tests on an N-triangle soup and check for cracks" << endl
+         << "  --packets               trace primary rays in coherent 4x4 packets" << endl
+         << "  --watertight            use the watertight ray/triangle test (no leaks along shared edges)" << endl
+         << "  --max-depth N           cap reflection paths at N segments (default: the scene's recursion level)" << endl
+         << "  --min-throughput W      end a path once its reflection weight falls below W (default 1e-4)" << endl
+         << "  --roulette W            Russian roulette for paths whose weight falls below W (default off)" << endl
+         << "  --light-exact K         shade every light when the scene has at most K, else sample (default 64)" << endl
+         << "  --light-samples S       shadow rays per hit when sampling lights from the light tree (default 8)" << endl
+         << "  --light-range R         ignore lights farther than R from the shaded point (default unlimited)" << endl
+         << "  --samples N             adaptive anti-aliasing: up to N samples per high-contrast pixel (default 1)" << endl
+         << "  --aa-threshold T        neighbourhood contrast that triggers refinement (default 0.1)" << endl
+         << "  --stream                write finished bands straight to --output (.bmp or .ppm) in bounded memory" << endl
+         << "  --tonemap OP            clamp (default), reinhard or aces" << endl
+         << "  --exposure STOPS        scale radiance by 2^STOPS before tone mapping (default 0)" << endl
+         << "  --pfm PATH              also save the raw float framebuffer as PFM" << endl
+         << "  --compare REF TEST      report the difference between two bitmaps, fail above --tolerance" << endl
+         << "  --tolerance T           largest RMSE in 8-bit steps that --compare accepts (default 2)" << endl
+         << "  --from-pfm PATH         tone-map a saved PFM to --output without rendering" << endl
+         << "  --texture               render the floor with its texture instead of the checkerboard" << endl
+         << "  --heatmap PATH          also write a false-colour bitmap of per-pixel cost" << endl
+         << "  --heatmap-metric M      heatmap cost: tests (intersection tests, default) or time (ns)" << endl
+         << "  --camera-pos X Y Z      camera position" << endl
+         << "  --camera-dir X Y Z      camera look direction, not straight up or down" << endl;
+}
+
+bool parseArguments(int argc, char** argv, RenderOptions& options) {
+    bool unknownArguments = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        int remaining = argc - i - 1;
+
+        if (arg == "--batch") {
+            options.batch = true;
+        } else if (arg == "--benchmark") {
+            options.batch = true;
+            options.benchmark = true;
+        } else if (arg == "--scene" && remaining >= 1) {
+            options.scenePath = argv[++i];
+        } else if (arg == "--convert" && remaining >= 1) {
+            options.batch = true;
+            options.convertPath = argv[++i];
+        } else if (arg == "--output" && remaining >= 1) {
+            options.outputPath = argv[++i];
+        } else if (arg == "--resolution" && remaining >= 1) {
+            options.resolution = atoi(argv[++i]);
+            if (options.resolution <= 0) return false;
+        } else if (arg == "--bench-triangles" && remaining >= 1) {
+            options.batch = true;
+            options.triangleBench = atoi(argv[++i]);
+            if (options.triangleBench <= 0) return false;
+        } else if (arg == "--packets") {
+            options.packets = true;
+        } else if (arg == "--watertight") {
+            options.watertight = true;
+        } else if (arg == "--max-depth" && remaining >= 1) {
+            options.maxDepth = atoi(argv[++i]);
+            if (options.maxDepth <= 0) return false;
+        } else if (arg == "--min-throughput" && remaining >= 1) {
+            options.minThroughput = atof(argv[++i]);
+            if (options.minThroughput < 0) return false;
+        } else if (arg == "--roulette" && remaining >= 1) {
+            options.roulette = atof(argv[++i]);
+            if (options.roulette <= 0 || options.roulette > 1) return false;
+        } else if (arg == "--light-exact" && remaining >= 1) {
+            options.lightExact = atoi(argv[++i]);
+            if (options.lightExact < 0) return false;
+        } else if (arg == "--light-samples" && remaining >= 1) {
+            options.lightSamples = atoi(argv[++i]);
+            if (options.lightSamples <= 0) return false;
+        } else if (arg == "--light-range" && remaining >= 1) {
+            options.lightRange = atof(argv[++i]);
+            if (options.lightRange <= 0) return false;
+        } else if (arg == "--samples" && remaining >= 1) {
+            options.samples = atoi(argv[++i]);
+            if (options.samples <= 0) return false;
+        } else if (arg == "--aa-threshold" && remaining >= 1) {
+            options.threshold = atof(argv[++i]);
+            if (options.threshold < 0) return false;
+        } else if (arg == "--stream") {
+            options.stream = true;
+        } else if (arg == "--tonemap" && remaining >= 1) {
+            string op = argv[++i];
+            if (op == "clamp") options.toneMap = TONEMAP_CLAMP;
+            else if (op == "reinhard") options.toneMap = TONEMAP_REINHARD;
+            else if (op == "aces") options.toneMap = TONEMAP_ACES;
+            else return false;
+        } else if (arg == "--exposure" && remaining >= 1) {
+            options.exposure = atof(argv[++i]);
+        } else if (arg == "--pfm" && remaining >= 1) {
+            options.pfmPath = argv[++i];
+        } else if (arg == "--from-pfm" && remaining >= 1) {
+            options.batch = true;
+            options.fromPfmPath = argv[++i];
+        } else if (arg == "--compare" && remaining >= 2) {
+            options.batch = true;
+            options.comparePath = argv[++i];
+            options.compareTestPath = argv[++i];
+        } else if (arg == "--tolerance" && remaining >= 1) {
+            options.tolerance = atof(argv[++i]);
+            if (options.tolerance < 0) return false;
+        } else if (arg == "--texture") {
+            options.texture = true;
+        } else if (arg == "--heatmap" && remaining >= 1) {
+            options.heatmapPath = argv[++i];
+        } else if (arg == "--heatmap-metric" && remaining >= 1) {
+            string metric = argv[++i];
+            if (metric != "tests" && metric != "time") return false;
+            options.heatmapNanoseconds = metric == "time";
+        } else if ((arg == "--threads" || arg == "-j") && remaining >= 1) {
+            options.threads = atoi(argv[++i]);
+        } else if (arg == "--camera-pos" && remaining >= 3) {
+            options.cameraPos = Vector3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
+            options.hasCameraPos = true;
+            i += 3;
+        } else if (arg == "--camera-dir" && remaining >= 3) {
+            options.cameraDir = Vector3D(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
+            options.hasCameraDir = true;
+            i += 3;
+            // The camera's right vector is dir x worldUp, which a zero or
+            // vertical direction leaves undefined.
+            Vector3D horizontal(options.cameraDir.x, options.cameraDir.y, 0);
+            if (!(lengthSquared(horizontal) > 1e-12 * lengthSquared(options.cameraDir))) return false;
+        } else if (arg == "--help" || arg == "-h") {
+            return false;
+        } else {
+            unknownArguments = true;
+        }
+    }
+    return !(options.batch && unknownArguments);
 }
 
 int main(int argc, char** argv) {
-    loadData();
+    RenderOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    renderThreads = options.threads;
+    packetTracing = options.packets;
+    watertightTriangles = options.watertight;
+    maxPathDepth = options.maxDepth;
+    minPathThroughput = options.minThroughput;
+    rouletteThroughput = options.roulette;
+    exactLightLimit = options.lightExact;
+    lightSamplesPerHit = options.lightSamples;
+    lightRange = options.lightRange;
+    maxPixelSamples = options.samples;
+    streamOutput = options.stream;
+    toneMapOperator = options.toneMap;
+    exposure = options.exposure;
+    pfmPath = options.pfmPath;
+    adaptiveThreshold = options.threshold;
+    heatmapPath = options.heatmapPath;
+    heatmapNanoseconds = options.heatmapNanoseconds;
+    if (options.benchmark) {
+        return runBenchmark(options);
+    }
+    if (options.triangleBench > 0) {
+        return runTriangleBenchmark(options.triangleBench);
+    }
+    if (!options.fromPfmPath.empty()) {
+        return toneMapPfm(options.fromPfmPath, options.outputPath) ? 0 : 1;
+    }
+    if (!options.comparePath.empty()) {
+        return compareImages(options.comparePath, options.compareTestPath, options.tolerance) ? 0 : 1;
+    }
 
-    glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
-    glutInitWindowSize(800, 800);
-    glutCreateWindow("Ray Tracer OpenGL Viewer");
+    double loadTime = 0;
+    {
+        ScopedTimer timer(&loadTime);
+        if (!loadData(options.scenePath)) {
+            return 1;
+        }
+        if (!scenePrebuilt) sceneBVH.build(objects);
+    }
+    cout << "Loaded " << objects.size() << " objects in " << loadTime * 1000 << " ms"
+         << (scenePrebuilt ? " (prebuilt BVH)" : "") << endl;
 
-    init();
+    if (!options.convertPath.empty()) {
+        bool saved = saveBinaryScene(options.convertPath);
+        if (saved) cout << "Binary scene written to " << options.convertPath << endl;
+        clearScene();
+        return saved ? 0 : 1;
+    }
 
-    glutDisplayFunc(display);
-    glutKeyboardFunc(keyboardListener);
-    glutSpecialFunc(specialKeyListener);
+    if (options.resolution > 0) imageResolution = options.resolution;
+    if (options.texture && globalFloor) globalFloor->useTexture = true;
+    if (options.hasCameraPos) cameraPos = options.cameraPos;
+    if (options.hasCameraDir) {
+        cameraLookDir = options.cameraDir;
+        updateCameraVectors();
+    }
 
-    glutMainLoop();
+    bool saved = true;
+    if (options.batch) {
+        saved = capture(options.outputPath);
+    } else {
+        glutInit(&argc, argv);
+        glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+        glutInitWindowSize(800, 800);
+        glutCreateWindow("Ray Tracer OpenGL Viewer");
 
-    for (Object* obj : objects) {
-        delete obj;
+        init();
+
+        glutDisplayFunc(display);
+        glutKeyboardFunc(keyboardListener);
+        glutSpecialFunc(specialKeyListener);
+        glutTimerFunc(50, previewTimer, 0);
+
+        glutMainLoop();
     }
-    objects.clear();
 
-    return 0;
-}
\ No newline at end of file
+    clearScene();
+
+    return saved ? 0 : 1;
+}
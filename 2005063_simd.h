@@ -0,0 +1,589 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+struct ScalarLanes {
+    static const int width = 1;
+    typedef double Vec;
+    typedef bool Mask;
+
+    static Vec load(const double* p) { return *p; }
+    static Vec load(const float* p) { return *p; }
+    static Vec set1(double x) { return x; }
+    static Vec add(Vec a, Vec b) { return a + b; }
+    static Vec sub(Vec a, Vec b) { return a - b; }
+    static Vec mul(Vec a, Vec b) { return a * b; }
+    static Vec div(Vec a, Vec b) { return a / b; }
+    static Vec sqrt(Vec a) { return std::sqrt(a); }
+    static Vec neg(Vec a) { return -a; }
+    static Vec abs(Vec a) { return std::fabs(a); }
+    static Vec min(Vec a, Vec b) { return a < b ? a : b; }
+    static Vec max(Vec a, Vec b) { return a > b ? a : b; }
+    static Mask lt(Vec a, Vec b) { return a < b; }
+    static Mask le(Vec a, Vec b) { return a <= b; }
+    static Mask gt(Vec a, Vec b) { return a > b; }
+    static Mask ge(Vec a, Vec b) { return a >= b; }
+    static Mask both(Mask a, Mask b) { return a && b; }
+    static Mask either(Mask a, Mask b) { return a || b; }
+    static Vec select(Mask m, Vec a, Vec b) { return m ? a : b; }
+    static bool any(Mask m) { return m; }
+    static int count(Mask m) { return m ? 1 : 0; }
+    static void store(double* p, Vec a) { *p = a; }
+};
+
+#if defined(__AVX512F__)
+struct SimdLanes {
+    static const int width = 8;
+    typedef __m512d Vec;
+    typedef __mmask8 Mask;
+
+    static Vec load(const double* p) { return _mm512_loadu_pd(p); }
+    static Vec load(const float* p) { return _mm512_maskz_cvtps_pd((__mmask8)0xFF, _mm256_loadu_ps(p)); }
+    static Vec set1(double x) { return _mm512_set1_pd(x); }
+    static Vec add(Vec a, Vec b) { return _mm512_add_pd(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm512_sub_pd(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm512_mul_pd(a, b); }
+    static Vec div(Vec a, Vec b) { return _mm512_div_pd(a, b); }
+    static Vec sqrt(Vec a) { return _mm512_maskz_sqrt_pd((__mmask8)0xFF, a); }
+    static Vec neg(Vec a) { return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(0x8000000000000000LL))); }
+    static Vec abs(Vec a) { return _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(0x7fffffffffffffffLL))); }
+    static Vec min(Vec a, Vec b) { return _mm512_maskz_min_pd((__mmask8)0xFF, a, b); }
+    static Vec max(Vec a, Vec b) { return _mm512_maskz_max_pd((__mmask8)0xFF, a, b); }
+    static Mask lt(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+    static Mask le(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+    static Mask gt(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+    static Mask ge(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ); }
+    static Mask both(Mask a, Mask b) { return a & b; }
+    static Mask either(Mask a, Mask b) { return a | b; }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_pd(m, b, a); }
+    static bool any(Mask m) { return m != 0; }
+    static int count(Mask m) { return __builtin_popcount(m); }
+    static void store(double* p, Vec a) { _mm512_storeu_pd(p, a); }
+};
+#elif defined(__AVX2__) || defined(__AVX__)
+struct SimdLanes {
+    static const int width = 4;
+    typedef __m256d Vec;
+    typedef __m256d Mask;
+
+    static Vec load(const double* p) { return _mm256_loadu_pd(p); }
+    static Vec load(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+    static Vec set1(double x) { return _mm256_set1_pd(x); }
+    static Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+    static Vec div(Vec a, Vec b) { return _mm256_div_pd(a, b); }
+    static Vec sqrt(Vec a) { return _mm256_sqrt_pd(a); }
+    static Vec neg(Vec a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+    static Vec abs(Vec a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+    static Vec min(Vec a, Vec b) { return _mm256_min_pd(a, b); }
+    static Vec max(Vec a, Vec b) { return _mm256_max_pd(a, b); }
+    static Mask lt(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static Mask le(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static Mask gt(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    static Mask ge(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+    static Mask both(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+    static Mask either(Mask a, Mask b) { return _mm256_or_pd(a, b); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_pd(b, a, m); }
+    static bool any(Mask m) { return _mm256_movemask_pd(m) != 0; }
+    static int count(Mask m) { return __builtin_popcount(_mm256_movemask_pd(m)); }
+    static void store(double* p, Vec a) { _mm256_storeu_pd(p, a); }
+};
+#elif defined(__SSE2__)
+struct SimdLanes {
+    static const int width = 2;
+    typedef __m128d Vec;
+    typedef __m128d Mask;
+
+    static Vec load(const double* p) { return _mm_loadu_pd(p); }
+    static Vec load(const float* p) { return _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double*)p))); }
+    static Vec set1(double x) { return _mm_set1_pd(x); }
+    static Vec add(Vec a, Vec b) { return _mm_add_pd(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm_sub_pd(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm_mul_pd(a, b); }
+    static Vec div(Vec a, Vec b) { return _mm_div_pd(a, b); }
+    static Vec sqrt(Vec a) { return _mm_sqrt_pd(a); }
+    static Vec neg(Vec a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+    static Vec abs(Vec a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+    static Vec min(Vec a, Vec b) { return _mm_min_pd(a, b); }
+    static Vec max(Vec a, Vec b) { return _mm_max_pd(a, b); }
+    static Mask lt(Vec a, Vec b) { return _mm_cmplt_pd(a, b); }
+    static Mask le(Vec a, Vec b) { return _mm_cmple_pd(a, b); }
+    static Mask gt(Vec a, Vec b) { return _mm_cmpgt_pd(a, b); }
+    static Mask ge(Vec a, Vec b) { return _mm_cmpge_pd(a, b); }
+    static Mask both(Mask a, Mask b) { return _mm_and_pd(a, b); }
+    static Mask either(Mask a, Mask b) { return _mm_or_pd(a, b); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+    static bool any(Mask m) { return _mm_movemask_pd(m) != 0; }
+    static int count(Mask m) { return __builtin_popcount(_mm_movemask_pd(m)); }
+    static void store(double* p, Vec a) { _mm_storeu_pd(p, a); }
+};
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+struct SimdLanes {
+    static const int width = 2;
+    typedef float64x2_t Vec;
+    typedef uint64x2_t Mask;
+
+    static Vec load(const double* p) { return vld1q_f64(p); }
+    static Vec load(const float* p) { return vcvt_f64_f32(vld1_f32(p)); }
+    static Vec set1(double x) { return vdupq_n_f64(x); }
+    static Vec add(Vec a, Vec b) { return vaddq_f64(a, b); }
+    static Vec sub(Vec a, Vec b) { return vsubq_f64(a, b); }
+    static Vec mul(Vec a, Vec b) { return vmulq_f64(a, b); }
+    static Vec div(Vec a, Vec b) { return vdivq_f64(a, b); }
+    static Vec sqrt(Vec a) { return vsqrtq_f64(a); }
+    static Vec neg(Vec a) { return vnegq_f64(a); }
+    static Vec abs(Vec a) { return vabsq_f64(a); }
+    static Vec min(Vec a, Vec b) { return vbslq_f64(vcltq_f64(a, b), a, b); }
+    static Vec max(Vec a, Vec b) { return vbslq_f64(vcgtq_f64(a, b), a, b); }
+    static Mask lt(Vec a, Vec b) { return vcltq_f64(a, b); }
+    static Mask le(Vec a, Vec b) { return vcleq_f64(a, b); }
+    static Mask gt(Vec a, Vec b) { return vcgtq_f64(a, b); }
+    static Mask ge(Vec a, Vec b) { return vcgeq_f64(a, b); }
+    static Mask both(Mask a, Mask b) { return vandq_u64(a, b); }
+    static Mask either(Mask a, Mask b) { return vorrq_u64(a, b); }
+    static Vec select(Mask m, Vec a, Vec b) { return vbslq_f64(m, a, b); }
+    static bool any(Mask m) { return (vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1)) != 0; }
+    static int count(Mask m) { return (int)(vgetq_lane_u64(m, 0) & 1) + (int)(vgetq_lane_u64(m, 1) & 1); }
+    static void store(double* p, Vec a) { vst1q_f64(p, a); }
+};
+#else
+typedef ScalarLanes SimdLanes;
+#endif
+
+// Vector3D across lanes: one register per component, with the same operation
+// order as the scalar dot and cross so every lane width agrees bit for bit.
+template <typename L>
+struct Vector3Lanes {
+    typename L::Vec x, y, z;
+
+    static Vector3Lanes set1(const Vector3D& v) {
+        return {L::set1(v.x), L::set1(v.y), L::set1(v.z)};
+    }
+};
+
+template <typename L>
+inline Vector3Lanes<L> operator-(const Vector3Lanes<L>& a, const Vector3Lanes<L>& b) {
+    return {L::sub(a.x, b.x), L::sub(a.y, b.y), L::sub(a.z, b.z)};
+}
+
+template <typename L>
+inline typename L::Vec dot(const Vector3Lanes<L>& a, const Vector3Lanes<L>& b) {
+    return L::add(L::add(L::mul(a.x, b.x), L::mul(a.y, b.y)), L::mul(a.z, b.z));
+}
+
+template <typename L>
+inline Vector3Lanes<L> cross(const Vector3Lanes<L>& a, const Vector3Lanes<L>& b) {
+    return {L::sub(L::mul(a.y, b.z), L::mul(a.z, b.y)),
+            L::sub(L::mul(a.z, b.x), L::mul(a.x, b.z)),
+            L::sub(L::mul(a.x, b.y), L::mul(a.y, b.x))};
+}
+
+enum PrimitiveKind {
+    PRIM_SPHERE,
+    PRIM_TRIANGLE,
+    PRIM_GENERAL,
+    PRIM_FLOOR,
+    PRIM_MESH,
+    PRIM_OTHER,
+    PRIM_KIND_COUNT
+};
+
+static const char* const primitiveKindNames[PRIM_KIND_COUNT] = {"sphere", "triangle", "general", "floor", "mesh", "other"};
+
+// Spheres keep their centre in v0 and squared radius in e1x; triangles keep
+// their first vertex in v0 and the two edges from it in e1/e2. Watertight
+// packs keep the other two vertices in e1/e2 instead, since edges rebuilt
+// from v0 + e1 would no longer match the neighbouring triangle bit for bit.
+// The arrays carry width - 1 zeroed entries past the last primitive so a
+// vector load that starts inside the pack never reads past the allocation.
+// They hold Real like the rest of the stored geometry and widen to double
+// lanes as they are loaded.
+struct PackedPrimitives {
+    std::vector<Real> v0x, v0y, v0z;
+    std::vector<Real> e1x, e1y, e1z;
+    std::vector<Real> e2x, e2y, e2z;
+    bool watertight = false;
+
+    void resize(int count) {
+        std::vector<Real>* fields[] = {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z};
+        for (auto* field : fields) field->assign(count + SimdLanes::width - 1, 0.0);
+    }
+
+    void setSphere(int i, const Vector3D& center, double radius) {
+        v0x[i] = center.x; v0y[i] = center.y; v0z[i] = center.z;
+        e1x[i] = radius * radius;
+    }
+
+    void setTriangle(int i, const Vector3D& p0, const Vector3D& p1, const Vector3D& p2) {
+        Vector3D edge1 = watertight ? p1 : p1 - p0;
+        Vector3D edge2 = watertight ? p2 : p2 - p0;
+        v0x[i] = p0.x; v0y[i] = p0.y; v0z[i] = p0.z;
+        e1x[i] = edge1.x; e1y[i] = edge1.y; e1z[i] = edge1.z;
+        e2x[i] = edge2.x; e2y[i] = edge2.y; e2z[i] = edge2.z;
+    }
+
+    Vector3D vertex(int i) const {
+        return Vector3D(v0x[i], v0y[i], v0z[i]);
+    }
+
+    Vector3D edge1(int i) const {
+        Vector3D e(e1x[i], e1y[i], e1z[i]);
+        return watertight ? e - vertex(i) : e;
+    }
+
+    Vector3D edge2(int i) const {
+        Vector3D e(e2x[i], e2y[i], e2z[i]);
+        return watertight ? e - vertex(i) : e;
+    }
+};
+
+// A 4x4 block of neighbouring rays in SoA form. Inactive lanes (pixels past
+// the image edge) keep a valid direction but a tNearest of -infinity so they
+// never hit anything.
+struct RayPacket {
+    static const int side = 4;
+    static const int size = side * side;
+
+    double ox[size], oy[size], oz[size];
+    double dx[size], dy[size], dz[size];
+    double invDx[size], invDy[size], invDz[size];
+    double tMin[size], tNearest[size];
+    int hitIndex[size];
+    int hitPart[size];
+    bool active[size];
+
+    bool sharedOrigin;
+    Vector3D frustumNormals[4];
+
+    void set(int lane, const Ray& ray, bool isActive) {
+        ox[lane] = ray.start.x; oy[lane] = ray.start.y; oz[lane] = ray.start.z;
+        dx[lane] = ray.dir.x; dy[lane] = ray.dir.y; dz[lane] = ray.dir.z;
+        invDx[lane] = ray.invDir.x; invDy[lane] = ray.invDir.y; invDz[lane] = ray.invDir.z;
+        active[lane] = isActive;
+        tMin[lane] = ray.tMin;
+        tNearest[lane] = isActive ? ray.tMax : -std::numeric_limits<double>::infinity();
+        hitIndex[lane] = -1;
+        hitPart[lane] = -1;
+    }
+
+    // Side planes through the shared origin and the four corner rays; only
+    // valid when every lane starts at the same point.
+    void buildFrustum() {
+        sharedOrigin = true;
+        for (int lane = 1; lane < size; lane++) {
+            if (ox[lane] != ox[0] || oy[lane] != oy[0] || oz[lane] != oz[0]) sharedOrigin = false;
+        }
+        if (!sharedOrigin) return;
+
+        int corners[4] = {0, side - 1, size - 1, size - side};
+        Vector3D center;
+        for (int k = 0; k < 4; k++) {
+            center = center + Vector3D(dx[corners[k]], dy[corners[k]], dz[corners[k]]);
+        }
+        for (int k = 0; k < 4; k++) {
+            int a = corners[k], b = corners[(k + 1) % 4];
+            Vector3D n(dy[a] * dz[b] - dz[a] * dy[b], dz[a] * dx[b] - dx[a] * dz[b], dx[a] * dy[b] - dy[a] * dx[b]);
+            if (n.x * center.x + n.y * center.y + n.z * center.z < 0) n = n * -1.0;
+            frustumNormals[k] = n;
+        }
+    }
+
+    bool frustumMisses(const Vector3D& boxMin, const Vector3D& boxMax) const {
+        if (!sharedOrigin) return false;
+        for (int k = 0; k < 4; k++) {
+            const Vector3D& n = frustumNormals[k];
+            double px = (n.x > 0 ? boxMax.x : boxMin.x) - ox[0];
+            double py = (n.y > 0 ? boxMax.y : boxMin.y) - oy[0];
+            double pz = (n.z > 0 ? boxMax.z : boxMin.z) - oz[0];
+            if (n.x * px + n.y * py + n.z * pz < 0) return true;
+        }
+        return false;
+    }
+};
+
+// Counts how coherent packet traversal stayed; a packet "splits" when some of
+// its lanes enter a node that others miss.
+struct PacketStats {
+    long long packets = 0;
+    long long splitPackets = 0;
+    long long nodeVisits = 0;
+    long long divergentNodes = 0;
+    long long frustumCulled = 0;
+
+    void add(const PacketStats& other) {
+        packets += other.packets;
+        splitPackets += other.splitPackets;
+        nodeVisits += other.nodeVisits;
+        divergentNodes += other.divergentNodes;
+        frustumCulled += other.frustumCulled;
+    }
+};
+
+// Same arithmetic, in the same order, as Sphere::intersect so every lane
+// width returns identical distances; the nearer root past tMin is returned
+// and misses come back as -1. The
+// discriminant is taken from the ray's closest approach rather than as
+// b^2 - ac, which cancels badly for far or grazing rays, and the direction
+// is not assumed to be exactly unit length.
+template <typename L>
+inline typename L::Vec sphereKernel(typename L::Vec ox, typename L::Vec oy, typename L::Vec oz,
+                                    typename L::Vec dx, typename L::Vec dy, typename L::Vec dz,
+                                    typename L::Vec cx, typename L::Vec cy, typename L::Vec cz, typename L::Vec radius2,
+                                    typename L::Vec tMin) {
+    typedef typename L::Vec V;
+    typedef Vector3Lanes<L> V3;
+    V3 oc = V3{ox, oy, oz} - V3{cx, cy, cz};
+    V3 d = {dx, dy, dz};
+
+    V a = dot(d, d);
+    V b = dot(oc, d);
+    V k = L::div(b, a);
+    V3 closest = oc - V3{L::mul(d.x, k), L::mul(d.y, k), L::mul(d.z, k)};
+    V discriminant = L::mul(a, L::sub(radius2, dot(closest, closest)));
+    typename L::Mask hit = L::ge(discriminant, L::set1(0.0));
+
+    V root = L::sqrt(L::select(hit, discriminant, L::set1(0.0)));
+    V t1 = L::div(L::sub(L::neg(b), root), a);
+    V t2 = L::div(L::add(L::neg(b), root), a);
+    V miss = L::set1(-1.0);
+    V t = L::select(L::gt(t1, tMin), t1, L::select(L::gt(t2, tMin), t2, miss));
+    return L::select(hit, t, miss);
+}
+
+// Möller–Trumbore in the same operation order as Triangle::intersect.
+template <typename L>
+inline typename L::Vec triangleKernel(typename L::Vec ox, typename L::Vec oy, typename L::Vec oz,
+                                      typename L::Vec dx, typename L::Vec dy, typename L::Vec dz,
+                                      typename L::Vec v0x, typename L::Vec v0y, typename L::Vec v0z,
+                                      typename L::Vec e1x, typename L::Vec e1y, typename L::Vec e1z,
+                                      typename L::Vec e2x, typename L::Vec e2y, typename L::Vec e2z) {
+    typedef typename L::Vec V;
+    typedef Vector3Lanes<L> V3;
+    V3 d = {dx, dy, dz}, e1 = {e1x, e1y, e1z}, e2 = {e2x, e2y, e2z};
+    V3 h = cross(d, e2);
+    V a = dot(e1, h);
+    typename L::Mask hit = L::ge(L::abs(a), L::set1(1e-6));
+
+    V f = L::div(L::set1(1.0), a);
+    V3 s = V3{ox, oy, oz} - V3{v0x, v0y, v0z};
+    V u = L::mul(f, dot(s, h));
+    hit = L::both(hit, L::both(L::ge(u, L::set1(0.0)), L::le(u, L::set1(1.0))));
+
+    V3 q = cross(s, e1);
+    V v = L::mul(f, dot(d, q));
+    hit = L::both(hit, L::both(L::ge(v, L::set1(0.0)), L::le(L::add(u, v), L::set1(1.0))));
+
+    V t = L::mul(f, dot(e2, q));
+    hit = L::both(hit, L::ge(t, L::set1(0.0)));
+    return L::select(hit, t, L::set1(-1.0));
+}
+
+// Watertight ray/triangle test (Woop, Benthin and Wald 2013). Vertices are
+// moved into a ray space where the ray runs along +z from the origin, then
+// tested with 2D edge functions. A vertex transforms the same way in every
+// triangle that shares it, so shared edges and vertices are classified
+// consistently and rays cannot slip between neighbours. The axis
+// permutation is chosen per lane, so lanes may hold different rays.
+template <typename L>
+inline typename L::Vec watertightKernel(typename L::Vec ox, typename L::Vec oy, typename L::Vec oz,
+                                        typename L::Vec dx, typename L::Vec dy, typename L::Vec dz,
+                                        typename L::Vec p0x, typename L::Vec p0y, typename L::Vec p0z,
+                                        typename L::Vec p1x, typename L::Vec p1y, typename L::Vec p1z,
+                                        typename L::Vec p2x, typename L::Vec p2y, typename L::Vec p2z) {
+    typedef typename L::Vec V;
+    typedef typename L::Mask M;
+    V zero = L::set1(0.0);
+
+    // kz is the dominant direction axis; kx/ky swap when it points down so
+    // the winding is preserved.
+    V adx = L::abs(dx), ady = L::abs(dy), adz = L::abs(dz);
+    M zMax = L::both(L::ge(adz, adx), L::ge(adz, ady));
+    M yMax = L::both(L::ge(ady, adx), L::gt(ady, adz));
+    V kzDir = L::select(zMax, dz, L::select(yMax, dy, dx));
+    M flip = L::lt(kzDir, zero);
+    auto permute = [&](V x, V y, V z, V& px, V& py, V& pz) {
+        V rx = L::select(zMax, x, L::select(yMax, z, y));
+        V ry = L::select(zMax, y, L::select(yMax, x, z));
+        px = L::select(flip, ry, rx);
+        py = L::select(flip, rx, ry);
+        pz = L::select(zMax, z, L::select(yMax, y, x));
+    };
+
+    V pdx, pdy, pdz;
+    permute(dx, dy, dz, pdx, pdy, pdz);
+    V shearX = L::div(pdx, pdz), shearY = L::div(pdy, pdz), shearZ = L::div(L::set1(1.0), pdz);
+
+    V ax, ay, az, bx, by, bz, cx, cy, cz;
+    permute(L::sub(p0x, ox), L::sub(p0y, oy), L::sub(p0z, oz), ax, ay, az);
+    permute(L::sub(p1x, ox), L::sub(p1y, oy), L::sub(p1z, oz), bx, by, bz);
+    permute(L::sub(p2x, ox), L::sub(p2y, oy), L::sub(p2z, oz), cx, cy, cz);
+    ax = L::sub(ax, L::mul(shearX, az)); ay = L::sub(ay, L::mul(shearY, az));
+    bx = L::sub(bx, L::mul(shearX, bz)); by = L::sub(by, L::mul(shearY, bz));
+    cx = L::sub(cx, L::mul(shearX, cz)); cy = L::sub(cy, L::mul(shearY, cz));
+
+    // Endpoints go in a fixed order so both triangles run the identical
+    // arithmetic on a shared edge even where the compiler fuses
+    // a * b - c * d into an FMA; the result is negated back after a swap.
+    auto edge = [&](V px, V py, V qx, V qy) {
+        M swap = L::either(L::lt(qx, px), L::both(L::le(qx, px), L::lt(qy, py)));
+        V sx = L::select(swap, qx, px), sy = L::select(swap, qy, py);
+        V ex = L::select(swap, px, qx), ey = L::select(swap, py, qy);
+        V e = L::sub(L::mul(sx, ey), L::mul(sy, ex));
+        return L::select(swap, L::neg(e), e);
+    };
+    V u = edge(cx, cy, bx, by);
+    V v = edge(ax, ay, cx, cy);
+    V w = edge(bx, by, ax, ay);
+
+    M inside = L::either(L::both(L::both(L::ge(u, zero), L::ge(v, zero)), L::ge(w, zero)),
+                         L::both(L::both(L::le(u, zero), L::le(v, zero)), L::le(w, zero)));
+    V det = L::add(L::add(u, v), w);
+    M hit = L::both(inside, L::gt(L::abs(det), zero));
+
+    V distance = L::add(L::add(L::mul(u, L::mul(shearZ, az)), L::mul(v, L::mul(shearZ, bz))), L::mul(w, L::mul(shearZ, cz)));
+    V t = L::div(distance, L::select(hit, det, L::set1(1.0)));
+    hit = L::both(hit, L::ge(t, zero));
+    return L::select(hit, t, L::set1(-1.0));
+}
+
+template <typename L>
+inline typename L::Vec sphereLanes(const PackedPrimitives& p, int i, const Ray& ray) {
+    return sphereKernel<L>(L::set1(ray.start.x), L::set1(ray.start.y), L::set1(ray.start.z),
+                           L::set1(ray.dir.x), L::set1(ray.dir.y), L::set1(ray.dir.z),
+                           L::load(&p.v0x[i]), L::load(&p.v0y[i]), L::load(&p.v0z[i]), L::load(&p.e1x[i]), L::set1(ray.tMin));
+}
+
+template <typename L>
+inline typename L::Vec triangleLanes(const PackedPrimitives& p, int i, const Ray& ray) {
+    if (p.watertight) {
+        return watertightKernel<L>(L::set1(ray.start.x), L::set1(ray.start.y), L::set1(ray.start.z),
+                                   L::set1(ray.dir.x), L::set1(ray.dir.y), L::set1(ray.dir.z),
+                                   L::load(&p.v0x[i]), L::load(&p.v0y[i]), L::load(&p.v0z[i]),
+                                   L::load(&p.e1x[i]), L::load(&p.e1y[i]), L::load(&p.e1z[i]),
+                                   L::load(&p.e2x[i]), L::load(&p.e2y[i]), L::load(&p.e2z[i]));
+    }
+    return triangleKernel<L>(L::set1(ray.start.x), L::set1(ray.start.y), L::set1(ray.start.z),
+                             L::set1(ray.dir.x), L::set1(ray.dir.y), L::set1(ray.dir.z),
+                             L::load(&p.v0x[i]), L::load(&p.v0y[i]), L::load(&p.v0z[i]),
+                             L::load(&p.e1x[i]), L::load(&p.e1y[i]), L::load(&p.e1z[i]),
+                             L::load(&p.e2x[i]), L::load(&p.e2y[i]), L::load(&p.e2z[i]));
+}
+
+template <typename L, int Kind>
+inline typename L::Vec kernelLanes(const PackedPrimitives& p, int i, const Ray& ray) {
+    return Kind == PRIM_SPHERE ? sphereLanes<L>(p, i, ray) : triangleLanes<L>(p, i, ray);
+}
+
+// Leaves rarely hold a multiple of the lane width, so the last block of a
+// leaf runs as a full vector over the padding PackedPrimitives keeps past
+// its end and only the live lanes are read back.
+template <int Kind>
+inline int intersectPacked(const PackedPrimitives& p, int first, int count, const Ray& ray, double& tNearest, int& hitIndex) {
+    int end = first + count, hits = 0;
+    for (int i = first; i < end; i += SimdLanes::width) {
+        double t[SimdLanes::width];
+        SimdLanes::store(t, kernelLanes<SimdLanes, Kind>(p, i, ray));
+        int live = std::min(SimdLanes::width, end - i);
+        for (int lane = 0; lane < live; lane++) {
+            if (t[lane] > ray.tMin) hits++;
+            if (t[lane] > ray.tMin && t[lane] < tNearest) {
+                tNearest = t[lane];
+                hitIndex = i + lane;
+            }
+        }
+    }
+    return hits;
+}
+
+template <int Kind>
+inline bool occludedPacked(const PackedPrimitives& p, int first, int count, const Ray& ray, int& tested) {
+    double tMin = ray.tMin, tMax = ray.tMax;
+    int i = first, end = first + count;
+    for (; i + SimdLanes::width <= end; i += SimdLanes::width) {
+        tested += SimdLanes::width;
+        SimdLanes::Vec t = kernelLanes<SimdLanes, Kind>(p, i, ray);
+        if (SimdLanes::any(SimdLanes::both(SimdLanes::gt(t, SimdLanes::set1(tMin)), SimdLanes::lt(t, SimdLanes::set1(tMax))))) return true;
+    }
+    if (i < end) {
+        double t[SimdLanes::width];
+        SimdLanes::store(t, kernelLanes<SimdLanes, Kind>(p, i, ray));
+        tested += end - i;
+        for (int lane = 0; lane < end - i; lane++) {
+            if (t[lane] > tMin && t[lane] < tMax) return true;
+        }
+    }
+    return false;
+}
+
+// Slab test of every packet lane against one box; returns how many live lanes
+// enter it before their current nearest hit.
+inline int packetEntersBox(const RayPacket& packet, const Vector3D& boxMin, const Vector3D& boxMax) {
+    typedef SimdLanes L;
+    int entering = 0;
+    for (int i = 0; i < RayPacket::size; i += L::width) {
+        L::Vec tx1 = L::mul(L::sub(L::set1(boxMin.x), L::load(&packet.ox[i])), L::load(&packet.invDx[i]));
+        L::Vec tx2 = L::mul(L::sub(L::set1(boxMax.x), L::load(&packet.ox[i])), L::load(&packet.invDx[i]));
+        L::Vec ty1 = L::mul(L::sub(L::set1(boxMin.y), L::load(&packet.oy[i])), L::load(&packet.invDy[i]));
+        L::Vec ty2 = L::mul(L::sub(L::set1(boxMax.y), L::load(&packet.oy[i])), L::load(&packet.invDy[i]));
+        L::Vec tz1 = L::mul(L::sub(L::set1(boxMin.z), L::load(&packet.oz[i])), L::load(&packet.invDz[i]));
+        L::Vec tz2 = L::mul(L::sub(L::set1(boxMax.z), L::load(&packet.oz[i])), L::load(&packet.invDz[i]));
+        L::Vec tNear = L::max(L::max(L::min(tx1, tx2), L::min(ty1, ty2)), L::min(tz1, tz2));
+        L::Vec tFar = L::min(L::min(L::max(tx1, tx2), L::max(ty1, ty2)), L::max(tz1, tz2));
+        L::Mask enters = L::both(L::ge(tFar, tNear), L::both(L::gt(tFar, L::load(&packet.tMin[i])), L::lt(tNear, L::load(&packet.tNearest[i]))));
+        entering += L::count(enters);
+    }
+    return entering;
+}
+
+template <int Kind>
+inline int intersectPacketLanes(const PackedPrimitives& p, int prim, RayPacket& packet) {
+    typedef SimdLanes L;
+    int hits = 0;
+    for (int i = 0; i < RayPacket::size; i += L::width) {
+        L::Vec ox = L::load(&packet.ox[i]), oy = L::load(&packet.oy[i]), oz = L::load(&packet.oz[i]);
+        L::Vec dx = L::load(&packet.dx[i]), dy = L::load(&packet.dy[i]), dz = L::load(&packet.dz[i]);
+        L::Vec t;
+        if (Kind == PRIM_SPHERE) {
+            t = sphereKernel<L>(ox, oy, oz, dx, dy, dz,
+                                L::set1(p.v0x[prim]), L::set1(p.v0y[prim]), L::set1(p.v0z[prim]), L::set1(p.e1x[prim]),
+                                L::load(&packet.tMin[i]));
+        } else if (p.watertight) {
+            t = watertightKernel<L>(ox, oy, oz, dx, dy, dz,
+                                    L::set1(p.v0x[prim]), L::set1(p.v0y[prim]), L::set1(p.v0z[prim]),
+                                    L::set1(p.e1x[prim]), L::set1(p.e1y[prim]), L::set1(p.e1z[prim]),
+                                    L::set1(p.e2x[prim]), L::set1(p.e2y[prim]), L::set1(p.e2z[prim]));
+        } else {
+            t = triangleKernel<L>(ox, oy, oz, dx, dy, dz,
+                                  L::set1(p.v0x[prim]), L::set1(p.v0y[prim]), L::set1(p.v0z[prim]),
+                                  L::set1(p.e1x[prim]), L::set1(p.e1y[prim]), L::set1(p.e1z[prim]),
+                                  L::set1(p.e2x[prim]), L::set1(p.e2y[prim]), L::set1(p.e2z[prim]));
+        }
+
+        double lanes[L::width];
+        L::store(lanes, t);
+        for (int lane = 0; lane < L::width; lane++) {
+            if (lanes[lane] > packet.tMin[i + lane] && packet.active[i + lane]) hits++;
+            if (lanes[lane] > packet.tMin[i + lane] && lanes[lane] < packet.tNearest[i + lane]) {
+                packet.tNearest[i + lane] = lanes[lane];
+                packet.hitIndex[i + lane] = prim;
+                packet.hitPart[i + lane] = -1;
+            }
+        }
+    }
+    return hits;
+}
+
+#endif